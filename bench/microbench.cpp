@@ -0,0 +1,337 @@
+// Microbenchmarks of the intersection and shading kernels. raytracer.cpp is
+// compiled in with its main renamed, so the kernels measured are the ones
+// the renderer uses. The inputs are recorded from the Test scenes: camera
+// rays through a jittered grid of pixels and shadow rays from their hits,
+// paired with every BVH box and leaf triangle their traversal tests, every
+// sphere, and the texture lookups and lights shaded at the hits. The jitter
+// has a fixed seed, so every run measures the same calls.
+//
+//   make microbench && ./microbench [--min-time MS] [--save FILE] [--compare FILE] [scene.xml...]
+//
+// --save writes the ns/call of every kernel to FILE, --compare prints them
+// next to the current ones, to compare builds before and after a change.
+
+#define main raytracer_main
+#include "../raytracer.cpp"
+#undef main
+
+#include <fstream>
+#include <iomanip>
+#include <map>
+
+struct BoxSample {
+    int ray;
+    Box* box;
+};
+
+struct FaceSample {
+    int ray;
+    Face* face;
+    Scene* scene;
+};
+
+struct SphereSample {
+    int ray;
+    Sphere* sphere;
+    Scene* scene;
+};
+
+struct TextureSample {
+    Texture* texture;
+    Vec2f uv;
+    double lod;
+    Vec3f kd;
+};
+
+struct ShadeSample {
+    Hit hit;
+    Surface surface;
+    PointLight* light;
+    Vec3f toLight; // normalized
+    double dSquare;
+};
+
+struct Samples {
+    std::vector<Ray> rays;
+    std::vector<BoxSample> boxes;
+    std::vector<FaceSample> faces;
+    std::vector<SphereSample> spheres;
+    std::vector<TextureSample> textures[2]; // by interpolation
+    std::vector<ShadeSample> shading;
+};
+
+static uint32_t seed = 1;
+
+static double Jitter()
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed * (1.0 / 4294967296.0);
+}
+
+// Records the boxes and leaf triangles that meshBVH tests for ray
+static void collectNode(Samples& samples, int ray, int node, Mesh& mesh, Scene& scene)
+{
+    if (node < 0 || node >= mesh.bvh_count)
+        return;
+    Box& box = mesh.bvh_data[node];
+    BoxSample boxSample = { ray, &box };
+    samples.boxes.push_back(boxSample);
+    if (!ray_box_intersect(samples.rays[ray], box))
+        return;
+    if (box.left < 0 && box.right < 0) {
+        for (int faceID = box.leftindex; faceID < box.rigthindex; faceID++) {
+            FaceSample faceSample = { ray, &mesh.face_data[faceID], &scene };
+            samples.faces.push_back(faceSample);
+        }
+        return;
+    }
+    collectNode(samples, ray, box.left, mesh, scene);
+    collectNode(samples, ray, box.right, mesh, scene);
+}
+
+// Records the intersection tests of ClosestHit for ray
+static void collectRay(Samples& samples, Ray& ray, Scene& scene)
+{
+    int index = samples.rays.size();
+    samples.rays.push_back(ray);
+    for (int meshID = 0; meshID < scene.meshes.size(); meshID++)
+        collectNode(samples, index, 0, scene.meshes[meshID], scene);
+    for (int triangleID = 0; triangleID < scene.triangles.size(); triangleID++) {
+        FaceSample faceSample = { index, &scene.triangles[triangleID].indices, &scene };
+        samples.faces.push_back(faceSample);
+    }
+    for (int sphereID = 0; sphereID < scene.spheres.size(); sphereID++) {
+        SphereSample sphereSample = { index, &scene.spheres[sphereID], &scene };
+        samples.spheres.push_back(sphereSample);
+    }
+}
+
+// Traces about raysPerCamera camera rays of every camera and records what they and their shadow rays do
+static void collectScene(Samples& samples, Scene& scene, int raysPerCamera)
+{
+    for (int cam = 0; cam < scene.cameras.size(); cam++) {
+        Camera& camera = scene.cameras[cam];
+        int step = MAX(1, (int)sqrt((double)camera.image_width * camera.image_height / raysPerCamera));
+        for (int i = 0; i < camera.image_height; i += step) {
+            for (int j = 0; j < camera.image_width; j += step) {
+                double dx = Jitter();
+                double dy = Jitter();
+                Ray ray = Generate(camera, i, j, dx, dy);
+                collectRay(samples, ray, scene);
+                Hit hit = ClosestHit(ray, scene);
+                if (!hit.hitOccur)
+                    continue;
+                TransferDifferentials(ray, hit);
+
+                Surface surface;
+                FetchSurface(ray, hit, scene, surface);
+                if (surface.texture) {
+                    TextureSample textureSample;
+                    textureSample.texture = surface.texture;
+                    textureSample.uv = surface.uv;
+                    textureSample.lod = hit.hasDifferentials ? TextureLod(hit, surface.uv, *surface.texture, scene) : 0;
+                    textureSample.kd = surface.material->diffuse;
+                    samples.textures[surface.texture->interpolation == BILINEAR].push_back(textureSample);
+                }
+
+                for (int lightNo = 0; lightNo < scene.point_lights.size(); lightNo++) {
+                    PointLight& light = scene.point_lights[lightNo];
+                    Ray shadow;
+                    shadow.dir = light.position - hit.intersectPoint;
+                    shadow.start = hit.intersectPoint + hit.normal * scene.shadow_ray_epsilon;
+                    collectRay(samples, shadow, scene);
+
+                    ShadeSample shadeSample;
+                    shadeSample.hit = hit;
+                    shadeSample.surface = surface;
+                    shadeSample.light = &light;
+                    shadeSample.dSquare = shadow.dir.dot(shadow.dir);
+                    shadeSample.toLight = shadow.dir.normalize();
+                    samples.shading.push_back(shadeSample);
+                }
+            }
+        }
+    }
+}
+
+static volatile double sink; // keeps the results of the kernels alive
+
+// Runs pass over all count samples until minSeconds have passed, returns ns per call
+template <typename Pass>
+static double measure(size_t count, double minSeconds, Pass pass)
+{
+    if (count == 0)
+        return 0;
+    pass(); // warm up
+    long passes = 0;
+    auto start = std::chrono::steady_clock::now();
+    double elapsed;
+    do {
+        sink = sink + pass();
+        passes++;
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    } while (elapsed < minSeconds);
+    return elapsed * 1e9 / ((double)passes * count);
+}
+
+struct Result {
+    std::string name;
+    size_t samples;
+    double ns;
+};
+
+static void printUsage(const char* program)
+{
+    std::cerr << "Usage: " << program << " [options] [scene.xml...]" << std::endl;
+    std::cerr << "  --min-time MS  time each kernel for at least MS milliseconds (default 300)" << std::endl;
+    std::cerr << "  --rays N      camera rays per camera of each scene (default 4096)" << std::endl;
+    std::cerr << "  --save FILE   write the ns/call of every kernel to FILE" << std::endl;
+    std::cerr << "  --compare FILE  show the ns/call saved in FILE next to the current ones" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    double minSeconds = 0.3;
+    int raysPerCamera = 4096;
+    std::string saveFile, compareFile;
+    std::vector<std::string> inputs;
+    for (int arg = 1; arg < argc; arg++) {
+        std::string flag = argv[arg];
+        if (flag == "--min-time" && arg + 1 < argc) {
+            minSeconds = atof(argv[++arg]) / 1000;
+        } else if (flag == "--rays" && arg + 1 < argc) {
+            raysPerCamera = atoi(argv[++arg]);
+        } else if (flag == "--save" && arg + 1 < argc) {
+            saveFile = argv[++arg];
+        } else if (flag == "--compare" && arg + 1 < argc) {
+            compareFile = argv[++arg];
+        } else if (flag.compare(0, 2, "--") == 0) {
+            printUsage(argv[0]);
+            return 1;
+        } else {
+            inputs.push_back(flag);
+        }
+    }
+    if (inputs.empty()) {
+        inputs.push_back("Test/horse.xml");
+        inputs.push_back("Test/simple_reflectance.xml");
+        inputs.push_back("Test/spheres_texture_nearest.xml");
+        inputs.push_back("Test/spheres_texture_bilinear.xml");
+    }
+
+    // the samples point into the scenes, which live until the end
+    Samples samples;
+    std::vector<Scene*> scenes;
+    for (int i = 0; i < inputs.size(); i++) {
+        Scene* scene = new Scene;
+        try {
+            scene->loadFromXml(inputs[i]);
+        } catch (std::exception& error) {
+            std::cerr << inputs[i] << ": " << error.what() << std::endl;
+            delete scene;
+            continue;
+        }
+        scenes.push_back(scene);
+        collectScene(samples, *scene, raysPerCamera);
+    }
+
+    std::vector<Result> results;
+    auto add = [&](const char* name, size_t count, double ns) {
+        Result result = { name, count, ns };
+        if (count)
+            results.push_back(result);
+    };
+
+    std::vector<Ray>& rays = samples.rays;
+    add("ray_box_intersect", samples.boxes.size(), measure(samples.boxes.size(), minSeconds, [&]() {
+        double hits = 0;
+        for (size_t i = 0; i < samples.boxes.size(); i++)
+            hits += ray_box_intersect(rays[samples.boxes[i].ray], *samples.boxes[i].box);
+        return hits;
+    }));
+    add("ray_triangle_intersect", samples.faces.size(), measure(samples.faces.size(), minSeconds, [&]() {
+        double sum = 0;
+        for (size_t i = 0; i < samples.faces.size(); i++)
+            sum += ray_triangle_intersect(rays[samples.faces[i].ray], *samples.faces[i].face, *samples.faces[i].scene);
+        return sum;
+    }));
+    add("ray_sphere_intersect", samples.spheres.size(), measure(samples.spheres.size(), minSeconds, [&]() {
+        double sum = 0;
+        for (size_t i = 0; i < samples.spheres.size(); i++)
+            sum += ray_sphere_intersect(rays[samples.spheres[i].ray], *samples.spheres[i].sphere, *samples.spheres[i].scene);
+        return sum;
+    }));
+    const char* textureNames[2] = { "texture nearest", "texture bilinear" };
+    for (int mode = 0; mode < 2; mode++) {
+        std::vector<TextureSample>& lookups = samples.textures[mode];
+        add(textureNames[mode], lookups.size(), measure(lookups.size(), minSeconds, [&]() {
+            double sum = 0;
+            for (size_t i = 0; i < lookups.size(); i++) {
+                TextureSample& lookup = lookups[i];
+                double diffuse[3], ambient[3];
+                lookup.texture->sampler(lookup.uv, *lookup.texture, lookup.lod, lookup.kd, diffuse, ambient);
+                sum += diffuse[0] + ambient[0];
+            }
+            return sum;
+        }));
+    }
+    add("Specular", samples.shading.size(), measure(samples.shading.size(), minSeconds, [&]() {
+        Vec3f color = { 0, 0, 0 };
+        for (size_t i = 0; i < samples.shading.size(); i++) {
+            ShadeSample& shade = samples.shading[i];
+            Specular(shade.hit, shade.surface, *shade.light, shade.toLight, shade.dSquare, color);
+        }
+        return color.x + color.y + color.z;
+    }));
+    add("Diffuse", samples.shading.size(), measure(samples.shading.size(), minSeconds, [&]() {
+        Vec3f color = { 0, 0, 0 };
+        for (size_t i = 0; i < samples.shading.size(); i++) {
+            ShadeSample& shade = samples.shading[i];
+            Diffuse(shade.hit, shade.surface, *shade.light, shade.toLight, shade.dSquare, color);
+        }
+        return color.x + color.y + color.z;
+    }));
+
+    std::map<std::string, double> old;
+    if (!compareFile.empty()) {
+        std::ifstream in(compareFile.c_str());
+        if (!in)
+            std::cerr << compareFile << ": cannot be read" << std::endl;
+        std::string line;
+        while (std::getline(in, line)) {
+            size_t tab = line.rfind('\t');
+            if (tab != std::string::npos)
+                old[line.substr(0, tab)] = atof(line.c_str() + tab + 1);
+        }
+    }
+
+    std::cout << std::left << std::setw(24) << "kernel" << std::right << std::setw(10) << "samples"
+              << std::setw(10) << "ns/call" << std::setw(12) << "Mcalls/s";
+    if (!old.empty())
+        std::cout << std::setw(10) << "old ns" << std::setw(10) << "speedup";
+    std::cout << std::endl;
+    std::cout << std::fixed;
+    for (int i = 0; i < results.size(); i++) {
+        Result& result = results[i];
+        std::cout << std::left << std::setw(24) << result.name << std::right << std::setw(10) << result.samples
+                  << std::setprecision(2) << std::setw(10) << result.ns << std::setw(12) << 1e3 / result.ns;
+        if (old.count(result.name))
+            std::cout << std::setw(10) << old[result.name] << std::setw(9) << old[result.name] / result.ns << "x";
+        std::cout << std::endl;
+    }
+
+    if (!saveFile.empty()) {
+        std::ofstream out(saveFile.c_str());
+        out << std::setprecision(4) << std::fixed;
+        for (int i = 0; i < results.size(); i++)
+            out << results[i].name << "\t" << results[i].ns << std::endl;
+        if (!out)
+            std::cerr << saveFile << ": cannot be written" << std::endl;
+    }
+
+    for (int i = 0; i < scenes.size(); i++)
+        delete scenes[i];
+    return 0;
+}
@@ -0,0 +1,116 @@
+#include "bvhcache.h"
+#include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
+
+#define BVH_CACHE_MAGIC "RTBVH"
+#define BVH_CACHE_VERSION 1
+
+struct BVHCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t face_size, box_size;
+    uint32_t face_count, node_count;
+    uint32_t padding;
+    uint64_t key;
+};
+
+static uint64_t mix(uint64_t h, const void* data, size_t size)
+{
+    // word at a time multiply/rotate hash, meshes can be hundreds of megabytes
+    const unsigned char* bytes = (const unsigned char*)data;
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, 8);
+        h = (h ^ word) * 0x100000001b3ULL;
+        h = (h << 29) | (h >> 35);
+        bytes += 8;
+        size -= 8;
+    }
+    while (size--)
+        h = (h ^ *bytes++) * 0x100000001b3ULL;
+    return h;
+}
+
+uint64_t bvh_cache_key(const std::vector<parser::Face>& faces, const parser::matrix& M)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    uint64_t count = faces.size();
+    h = mix(h, &count, sizeof(count));
+    h = mix(h, faces.data(), faces.size() * sizeof(parser::Face));
+    h = mix(h, M.translator, sizeof(M.translator));
+    return h;
+}
+
+static std::string cachePath(const std::string& dir, uint64_t key)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.bvh", (unsigned long long)key);
+    return dir + name;
+}
+
+static void header(BVHCacheHeader& h, uint64_t key)
+{
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, BVH_CACHE_MAGIC, sizeof(BVH_CACHE_MAGIC));
+    h.version = BVH_CACHE_VERSION;
+    h.face_size = sizeof(parser::Face);
+    h.box_size = sizeof(parser::Box);
+    h.key = key;
+}
+
+bool bvh_cache_load(const std::string& dir, uint64_t key, parser::Mesh& mesh, MappedFile& file)
+{
+    if (!map_file(cachePath(dir, key).c_str(), file))
+        return false;
+
+    BVHCacheHeader expected, h;
+    header(expected, key);
+    if (file.size < sizeof(h)) {
+        unmap_file(file);
+        return false;
+    }
+    memcpy(&h, file.data, sizeof(h));
+    expected.face_count = h.face_count;
+    expected.node_count = h.node_count;
+    size_t size = sizeof(h) + (size_t)h.face_count * sizeof(parser::Face) + (size_t)h.node_count * sizeof(parser::Box);
+    // a stale or foreign file is simply rebuilt
+    if (memcmp(&h, &expected, sizeof(h)) || h.face_count != mesh.faces.size() || h.node_count == 0 || file.size != size) {
+        unmap_file(file);
+        return false;
+    }
+
+    char* data = (char*)file.data + sizeof(h);
+    mesh.face_data = (parser::Face*)data;
+    mesh.face_count = h.face_count;
+    mesh.bvh_data = (parser::Box*)(data + (size_t)h.face_count * sizeof(parser::Face));
+    mesh.bvh_count = h.node_count;
+    return true;
+}
+
+void bvh_cache_store(const std::string& dir, uint64_t key, parser::Mesh& mesh)
+{
+    mkdir(dir.c_str(), 0777);
+
+    BVHCacheHeader h;
+    header(h, key);
+    h.face_count = mesh.faces.size();
+    h.node_count = mesh.bvh.size();
+
+    // written under a temporary name so a concurrent reader never sees half a file
+    std::string path = cachePath(dir, key);
+    std::string temp = path + ".tmp";
+    FILE* out = fopen(temp.c_str(), "wb");
+    if (out == NULL) {
+        fprintf(stderr, "can't write bvh cache %s\n", temp.c_str());
+        return;
+    }
+    bool ok = fwrite(&h, sizeof(h), 1, out) == 1;
+    ok = ok && fwrite(mesh.faces.data(), sizeof(parser::Face), mesh.faces.size(), out) == mesh.faces.size();
+    ok = ok && fwrite(mesh.bvh.data(), sizeof(parser::Box), mesh.bvh.size(), out) == mesh.bvh.size();
+    ok = fclose(out) == 0 && ok;
+    if (!ok || rename(temp.c_str(), path.c_str()) != 0) {
+        fprintf(stderr, "can't write bvh cache %s\n", path.c_str());
+        remove(temp.c_str());
+    }
+}
@@ -0,0 +1,18 @@
+#ifndef __bvhcache_h__
+#define __bvhcache_h__
+
+#include "parser.h"
+#include <stdint.h>
+
+// Built mesh BVHs stored as <dir>/<key>.bvh, where the key hashes the
+// transformed faces (in parse order) and the mesh transformation
+
+uint64_t bvh_cache_key(const std::vector<parser::Face>& faces, const parser::matrix& M);
+
+// On a hit, points face_data/bvh_data of mesh into the mapped cache file
+bool bvh_cache_load(const std::string& dir, uint64_t key, parser::Mesh& mesh, MappedFile& file);
+
+// Writes the sorted faces and nodes of a freshly built mesh
+void bvh_cache_store(const std::string& dir, uint64_t key, parser::Mesh& mesh);
+
+#endif // __bvhcache_h__
@@ -0,0 +1,302 @@
+#include "parser.h"
+#include "sampler.h"
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <stdint.h>
+
+// Layout of a compiled scene, every block starts on an 8 byte boundary:
+//   header, scene constants, cameras, point lights, materials, triangles,
+//   spheres, textures (modes, then size and tiled texels of every mip level,
+//   texels on a 64 byte boundary), environment map (face size, texels),
+//   meshes (faces, BVH nodes).
+// Faces, BVH nodes and texels are used straight from the mapping,
+// the remaining small arrays are copied out.
+
+#define COMPILED_MAGIC "RTSCENE"
+#define COMPILED_VERSION 4
+
+struct CompiledHeader {
+    char magic[8];
+    uint32_t version;
+    // sizes of the raw structs, a build with a different layout must not read the file
+    uint32_t face_size, box_size, triangle_size, sphere_size, material_size, light_size;
+};
+
+static void header(CompiledHeader& h)
+{
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, COMPILED_MAGIC, sizeof(COMPILED_MAGIC));
+    h.version = COMPILED_VERSION;
+    h.face_size = sizeof(parser::Face);
+    h.box_size = sizeof(parser::Box);
+    h.triangle_size = sizeof(parser::Triangle);
+    h.sphere_size = sizeof(parser::Sphere);
+    h.material_size = sizeof(parser::Material);
+    h.light_size = sizeof(parser::PointLight);
+}
+
+struct CompiledWriter {
+    FILE* out;
+    size_t offset;
+
+    void put(const void* data, size_t size)
+    {
+        static const char zeros[8] = { 0 };
+        if (size && fwrite(data, 1, size, out) != size)
+            throw std::runtime_error("Error: The compiled scene cannot be written.");
+        offset += size;
+        size_t pad = (8 - offset % 8) % 8;
+        if (pad && fwrite(zeros, 1, pad, out) != pad)
+            throw std::runtime_error("Error: The compiled scene cannot be written.");
+        offset += pad;
+    }
+    template <typename T>
+    void put(const T& value)
+    {
+        put(&value, sizeof(T));
+    }
+    void align(size_t boundary)
+    {
+        static const char zeros[64] = { 0 };
+        size_t pad = (boundary - offset % boundary) % boundary;
+        if (pad && fwrite(zeros, 1, pad, out) != pad)
+            throw std::runtime_error("Error: The compiled scene cannot be written.");
+        offset += pad;
+    }
+    template <typename T>
+    void putArray(const T* data, uint64_t count)
+    {
+        put(count);
+        put(data, sizeof(T) * count);
+    }
+    void putString(const std::string& text)
+    {
+        putArray(text.data(), text.size());
+    }
+};
+
+struct CompiledReader {
+    char* base;
+    size_t size;
+    size_t offset;
+
+    void* take(size_t bytes)
+    {
+        if (bytes > size - offset)
+            throw std::runtime_error("Error: The compiled scene is truncated.");
+        void* data = base + offset;
+        offset += bytes;
+        offset += (8 - offset % 8) % 8;
+        if (offset > size)
+            offset = size;
+        return data;
+    }
+    void align(size_t boundary)
+    {
+        offset += (boundary - offset % boundary) % boundary;
+        if (offset > size)
+            offset = size;
+    }
+    template <typename T>
+    T get()
+    {
+        T value;
+        memcpy(&value, take(sizeof(T)), sizeof(T));
+        return value;
+    }
+    template <typename T>
+    T* getArray(uint64_t& count)
+    {
+        count = get<uint64_t>();
+        if (count > size / sizeof(T))
+            throw std::runtime_error("Error: The compiled scene is truncated.");
+        return (T*)take(sizeof(T) * count);
+    }
+    template <typename T>
+    void getVector(std::vector<T>& out)
+    {
+        uint64_t count;
+        T* data = getArray<T>(count);
+        out.assign(data, data + count);
+    }
+    std::string getString()
+    {
+        uint64_t count;
+        char* data = getArray<char>(count);
+        return std::string(data, count);
+    }
+};
+
+void parser::Scene::saveCompiled(const std::string& filepath)
+{
+    CompiledWriter writer;
+    writer.offset = 0;
+    if ((writer.out = fopen(filepath.c_str(), "wb")) == NULL)
+        throw std::runtime_error("Error: The compiled scene cannot be opened for writing.");
+
+    try {
+        CompiledHeader h;
+        header(h);
+        writer.put(h);
+
+        writer.put(background_color);
+        writer.put(shadow_ray_epsilon);
+        writer.put(max_recursion_depth);
+        writer.put(ambient_light);
+
+        writer.put((uint64_t)cameras.size());
+        for (int i = 0; i < cameras.size(); i++) {
+            Camera& camera = cameras[i];
+            writer.put(camera.position);
+            writer.put(camera.gaze);
+            writer.put(camera.up);
+            writer.put(camera.right);
+            writer.put(camera.topleft);
+            writer.put(camera.halfpixelR);
+            writer.put(camera.halfpixelD);
+            writer.put(camera.near_plane);
+            writer.put(camera.near_distance);
+            writer.put(camera.image_width);
+            writer.put(camera.image_height);
+            writer.putString(camera.image_name);
+        }
+
+        writer.putArray(point_lights.data(), point_lights.size());
+        writer.putArray(materials.data(), materials.size());
+        writer.putArray(triangles.data(), triangles.size());
+        writer.putArray(spheres.data(), spheres.size());
+
+        writer.put((uint64_t)textures.size());
+        for (int i = 0; i < textures.size(); i++) {
+            Texture& texture = textures[i];
+            if (texture.streamed)
+                throw std::runtime_error("Error: Scenes with streamed textures cannot be compiled.");
+            writer.put(texture.interpolation);
+            writer.put(texture.colormode);
+            writer.put(texture.repeatmode);
+            writer.put((uint64_t)texture.levels.size());
+            for (int l = 0; l < texture.levels.size(); l++) {
+                MipLevel& level = texture.levels[l];
+                writer.put(level.width);
+                writer.put(level.height);
+                writer.put(level.blocks_per_row);
+                writer.put((uint64_t)level.size());
+                writer.align(64);
+                writer.put(level.texels, level.size() * sizeof(uint32_t));
+            }
+        }
+
+        writer.put(environment.face_size);
+        writer.putArray(environment.texels.data(), environment.texels.size());
+
+        writer.put((uint64_t)meshes.size());
+        for (int i = 0; i < meshes.size(); i++) {
+            Mesh& mesh = meshes[i];
+            writer.put(mesh.material_id);
+            writer.put(mesh.texture_id);
+            writer.putArray(mesh.face_data, mesh.face_count);
+            writer.putArray(mesh.bvh_data, mesh.bvh_count);
+        }
+    } catch (...) {
+        fclose(writer.out);
+        throw;
+    }
+    fclose(writer.out);
+}
+
+void parser::Scene::loadCompiled(const std::string& filepath)
+{
+    MappedFile file;
+    if (!map_file(filepath.c_str(), file))
+        throw std::runtime_error("Error: The compiled scene cannot be mapped.");
+    mappings.push_back(file);
+
+    CompiledReader reader;
+    reader.base = (char*)file.data;
+    reader.size = file.size;
+    reader.offset = 0;
+
+    CompiledHeader expected, h;
+    header(expected);
+    h = reader.get<CompiledHeader>();
+    if (memcmp(h.magic, expected.magic, sizeof(h.magic)))
+        throw std::runtime_error("Error: Not a compiled scene file.");
+    if (memcmp(&h, &expected, sizeof(h)))
+        throw std::runtime_error("Error: The compiled scene was written by a different version, compile it again.");
+
+    background_color = reader.get<Vec3i>();
+    shadow_ray_epsilon = reader.get<float>();
+    max_recursion_depth = reader.get<int>();
+    ambient_light = reader.get<Vec3f>();
+
+    uint64_t count = reader.get<uint64_t>();
+    for (uint64_t i = 0; i < count; i++) {
+        Camera camera;
+        camera.position = reader.get<Vec3f>();
+        camera.gaze = reader.get<Vec3f>();
+        camera.up = reader.get<Vec3f>();
+        camera.right = reader.get<Vec3f>();
+        camera.topleft = reader.get<Vec3f>();
+        camera.halfpixelR = reader.get<Vec3f>();
+        camera.halfpixelD = reader.get<Vec3f>();
+        camera.near_plane = reader.get<Vec4f>();
+        camera.near_distance = reader.get<float>();
+        camera.image_width = reader.get<int>();
+        camera.image_height = reader.get<int>();
+        camera.image_name = reader.getString();
+        cameras.push_back(camera);
+    }
+
+    reader.getVector(point_lights);
+    reader.getVector(materials);
+    for (int i = 0; i < materials.size(); i++)
+        materials[i].classify();
+    reader.getVector(triangles);
+    reader.getVector(spheres);
+
+    count = reader.get<uint64_t>();
+    for (uint64_t i = 0; i < count; i++) {
+        Texture texture;
+        texture.interpolation = reader.get<int>();
+        texture.colormode = reader.get<int>();
+        texture.repeatmode = reader.get<int>();
+        uint64_t levels = reader.get<uint64_t>();
+        if (levels == 0)
+            throw std::runtime_error("Error: The compiled scene has a texture without pixels.");
+        for (uint64_t l = 0; l < levels; l++) {
+            MipLevel level;
+            level.width = reader.get<int>();
+            level.height = reader.get<int>();
+            level.blocks_per_row = reader.get<int>();
+            uint64_t size = reader.get<uint64_t>();
+            if (level.width <= 0 || level.height <= 0 || level.blocks_per_row != (level.width + TILE_SIZE - 1) / TILE_SIZE || size != level.size())
+                throw std::runtime_error("Error: The compiled scene has a texture of the wrong size.");
+            reader.align(64);
+            level.texels = (uint32_t*)reader.take(size * sizeof(uint32_t));
+            texture.levels.push_back(level);
+        }
+        texture.width = texture.levels[0].width;
+        texture.height = texture.levels[0].height;
+        texture.sampler = texture_sampler(texture);
+        textures.push_back(texture);
+    }
+
+    environment.face_size = reader.get<int>();
+    reader.getVector(environment.texels);
+    if (environment.texels.size() != (size_t)6 * environment.face_size * environment.face_size)
+        throw std::runtime_error("Error: The compiled scene has an environment map of the wrong size.");
+
+    count = reader.get<uint64_t>();
+    meshes.resize(count);
+    for (uint64_t i = 0; i < count; i++) {
+        Mesh& mesh = meshes[i];
+        mesh.material_id = reader.get<int>();
+        mesh.texture_id = reader.get<int>();
+        uint64_t size;
+        mesh.face_data = reader.getArray<Face>(size);
+        mesh.face_count = size;
+        mesh.bvh_data = reader.getArray<Box>(size);
+        mesh.bvh_count = size;
+    }
+}
@@ -1,81 +1,75 @@
 #include "jpeg.h"
+#include <csetjmp>
 #include <cstdio>
 #include <cstdlib>
 #include <jpeglib.h>
 #include <stdexcept>
+#include <string>
 
-void read_jpeg_header(const char* filename, int& width, int& height)
-{
-    struct jpeg_decompress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-
-    FILE* infile;
-
-    /* create jpeg decompress object */
-    cinfo.err = jpeg_std_error(&jerr);
-    jpeg_create_decompress(&cinfo);
-
-    /* set input file name */
-    if ((infile = fopen(filename, "rb")) == NULL) {
-        fprintf(stderr, "can't open %s\n", filename);
-        exit(1);
-    }
-
-    jpeg_stdio_src(&cinfo, infile);
-
-    /* read header */
-    jpeg_read_header(&cinfo, TRUE);
+/* error manager that jumps back instead of calling exit(), so callers get an exception */
+struct jpeg_error_jump {
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+    char message[JMSG_LENGTH_MAX];
+};
 
-    jpeg_start_decompress(&cinfo);
-    width = cinfo.output_width;
-    height = cinfo.output_height;
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+    jpeg_error_jump* err = (jpeg_error_jump*)cinfo->err;
+    (*cinfo->err->format_message)(cinfo, err->message);
+    longjmp(err->jump, 1);
 }
 
-void read_jpeg(const char* filename, unsigned char* image, int width, int height)
+void read_jpeg_image(const char* filename, unsigned char*& image, int& width, int& height)
 {
     struct jpeg_decompress_struct cinfo;
-    struct jpeg_error_mgr jerr;
+    jpeg_error_jump jerr;
 
     FILE* infile;
-    JSAMPROW row_pointer; /* pointer to a row */
-    int j, k;
-
-    /* create jpeg decompress object */
-    cinfo.err = jpeg_std_error(&jerr);
-    jpeg_create_decompress(&cinfo);
+    JSAMPROW row_pointers[16];
 
     /* set input file name */
     if ((infile = fopen(filename, "rb")) == NULL) {
-        fprintf(stderr, "can't open %s\n", filename);
-        exit(1);
+        throw std::runtime_error(std::string("Error: can't open ") + filename);
     }
 
+    /* volatile since it is read after longjmp */
+    unsigned char* volatile decoded = NULL;
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = jpeg_error_exit;
+    if (setjmp(jerr.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        fclose(infile);
+        delete[] decoded;
+        throw std::runtime_error(std::string("Error: ") + filename + ": " + jerr.message);
+    }
+    jpeg_create_decompress(&cinfo);
     jpeg_stdio_src(&cinfo, infile);
 
     /* read header */
     jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = JCS_RGB;
 
     jpeg_start_decompress(&cinfo);
-    if (width != cinfo.output_width || height != cinfo.output_height) {
-        throw std::runtime_error("Error: Actual JPEG resolution does not match the provided one.");
-    }
-
-    row_pointer = (JSAMPROW)malloc(sizeof(JSAMPLE) * (width)*3);
+    width = cinfo.output_width;
+    height = cinfo.output_height;
+    size_t stride = (size_t)width * 3;
+    decoded = new unsigned char[stride * height];
 
+    /* decode scanlines straight into the final buffer */
     while (cinfo.output_scanline < cinfo.output_height) {
-        jpeg_read_scanlines(&cinfo, &row_pointer, 1);
-
-        for (j = 0; j < width; j++) {
-            for (k = 0; k < 3; k++) {
-                image[(cinfo.output_scanline - 1) * width * 3 + j * 3 + k] = (unsigned char)row_pointer[3 * j + k];
-            }
-        }
+        int rows = cinfo.output_height - cinfo.output_scanline;
+        if (rows > 16)
+            rows = 16;
+        for (int j = 0; j < rows; j++)
+            row_pointers[j] = decoded + (cinfo.output_scanline + j) * stride;
+        jpeg_read_scanlines(&cinfo, row_pointers, rows);
     }
 
     jpeg_finish_decompress(&cinfo);
     fclose(infile);
-    free(row_pointer);
     jpeg_destroy_decompress(&cinfo);
+    image = decoded;
 }
 
 void write_jpeg(const char* filename, unsigned char* image, int width, int height)
@@ -122,3 +116,81 @@ void write_jpeg(const char* filename, unsigned char* image, int width, int heigh
     free(row_pointer);
     jpeg_destroy_compress(&cinfo);
 }
+
+struct jpeg_stream {
+    struct jpeg_compress_struct cinfo;
+    jpeg_error_jump jerr;
+    FILE* outfile;
+};
+
+jpeg_stream* jpeg_stream_open(const char* filename, int width, int height)
+{
+    jpeg_stream* stream = new jpeg_stream;
+
+    /* create jpeg compress object */
+    stream->cinfo.err = jpeg_std_error(&stream->jerr.pub);
+    stream->jerr.pub.error_exit = jpeg_error_exit;
+    jpeg_create_compress(&stream->cinfo);
+
+    /* set output file name */
+    if ((stream->outfile = fopen(filename, "wb")) == NULL) {
+        jpeg_destroy_compress(&stream->cinfo);
+        delete stream;
+        throw std::runtime_error("Error: The jpeg file cannot be opened for writing.");
+    }
+    if (setjmp(stream->jerr.jump)) {
+        std::string message = stream->jerr.message;
+        jpeg_destroy_compress(&stream->cinfo);
+        fclose(stream->outfile);
+        delete stream;
+        throw std::runtime_error("Error: " + message);
+    }
+    jpeg_stdio_dest(&stream->cinfo, stream->outfile);
+
+    /* set parameters */
+    stream->cinfo.image_width = width;
+    stream->cinfo.image_height = height;
+    stream->cinfo.input_components = 3;
+    stream->cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&stream->cinfo);
+    jpeg_set_quality(&stream->cinfo, 100, TRUE);
+
+    jpeg_start_compress(&stream->cinfo, TRUE);
+    return stream;
+}
+
+void jpeg_stream_write(jpeg_stream* stream, const unsigned char* rows, int count)
+{
+    size_t stride = (size_t)stream->cinfo.image_width * 3;
+    /* the stream stays open, the caller aborts it */
+    if (setjmp(stream->jerr.jump))
+        throw std::runtime_error(std::string("Error: ") + stream->jerr.message);
+    for (int j = 0; j < count; j++) {
+        /* rows are already packed RGB so they can be handed over directly */
+        JSAMPROW row_pointer = (JSAMPROW)(rows + j * stride);
+        jpeg_write_scanlines(&stream->cinfo, &row_pointer, 1);
+    }
+}
+
+void jpeg_stream_close(jpeg_stream* stream)
+{
+    if (setjmp(stream->jerr.jump)) {
+        std::string message = stream->jerr.message;
+        jpeg_stream_abort(stream);
+        throw std::runtime_error("Error: " + message);
+    }
+    jpeg_finish_compress(&stream->cinfo);
+    bool closed = fclose(stream->outfile) == 0;
+    jpeg_destroy_compress(&stream->cinfo);
+    delete stream;
+    if (!closed)
+        throw std::runtime_error("Error: The jpeg file cannot be written.");
+}
+
+void jpeg_stream_abort(jpeg_stream* stream)
+{
+    jpeg_abort_compress(&stream->cinfo);
+    fclose(stream->outfile);
+    jpeg_destroy_compress(&stream->cinfo);
+    delete stream;
+}
@@ -1,8 +1,16 @@
 #ifndef __jpeg_h__
 #define __jpeg_h__
 
-void read_jpeg_header(const char* filename, int& width, int& height);
-void read_jpeg(const char* filename, unsigned char* image, int width, int height);
+// Opens and decodes the file once, image is allocated with new[] and holds width * height RGB pixels
+void read_jpeg_image(const char* filename, unsigned char*& image, int& width, int& height);
 void write_jpeg(const char* filename, unsigned char* image, int width, int height);
 
+// Scanline writer that takes the image a few rows at a time
+struct jpeg_stream;
+jpeg_stream* jpeg_stream_open(const char* filename, int width, int height);
+void jpeg_stream_write(jpeg_stream* stream, const unsigned char* rows, int count);
+void jpeg_stream_close(jpeg_stream* stream);
+// Gives up on an unfinished image, the rows written so far stay in the file
+void jpeg_stream_abort(jpeg_stream* stream);
+
 #endif //__jpeg_h__
@@ -0,0 +1,37 @@
+#include "mapped.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+bool map_file(const char* filename, MappedFile& file)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        return false;
+    }
+
+    // private and writable so the data can be used through non-const pointers,
+    // pages are only copied if somebody actually writes to them
+    void* data = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+
+    file.data = data;
+    file.size = info.st_size;
+    return true;
+}
+
+void unmap_file(MappedFile& file)
+{
+    if (file.data)
+        munmap(file.data, file.size);
+    file.data = NULL;
+    file.size = 0;
+}
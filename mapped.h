@@ -0,0 +1,16 @@
+#ifndef __mapped_h__
+#define __mapped_h__
+
+#include <cstddef>
+
+// A whole file mapped copy-on-write into memory
+struct MappedFile {
+    void* data;
+    size_t size;
+};
+
+// Returns false if the file cannot be opened or mapped
+bool map_file(const char* filename, MappedFile& file);
+void unmap_file(MappedFile& file);
+
+#endif // __mapped_h__
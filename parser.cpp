@@ -1,7 +1,13 @@
 #include "parser.h"
+#include "bvhcache.h"
+#include "pool.h"
+#include "sampler.h"
+#include "timer.h"
 #include "tinyxml2.h"
+#include <cstdlib>
 #include <sstream>
 #include <stdexcept>
+#include <stdint.h>
 
 bool mysortx(parser::Face& first, parser::Face& second)
 {
@@ -16,13 +22,126 @@ bool mysortz(parser::Face& first, parser::Face& second)
     return first.max[2] < second.max[2];
 }
 
+// Reads numbers straight out of tinyxml2's text buffer, without copying it
+// into a stream. Plain decimals are converted exactly with a single multiply
+// or divide, anything else (long mantissas, large exponents) goes to strtod.
+struct NumberReader {
+    const char* p;
+    NumberReader(const char* text)
+    {
+        p = text ? text : "";
+    }
+
+    bool more()
+    {
+        while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+            p++;
+        return *p != '\0';
+    }
+
+    // Number of whitespace separated tokens left, used to reserve vectors
+    size_t count() const
+    {
+        size_t tokens = 0;
+        bool inside = false;
+        for (const char* q = p; *q; q++) {
+            bool space = *q == ' ' || *q == '\t' || *q == '\n' || *q == '\r';
+            if (!space && !inside)
+                tokens++;
+            inside = !space;
+        }
+        return tokens;
+    }
+
+    int readInt()
+    {
+        if (!more())
+            throw std::runtime_error("Error: Unexpected end of number list.");
+        bool negative = *p == '-';
+        if (*p == '-' || *p == '+')
+            p++;
+        if (*p < '0' || *p > '9')
+            throw std::runtime_error("Error: Invalid integer in number list.");
+        int value = 0;
+        while (*p >= '0' && *p <= '9')
+            value = value * 10 + (*p++ - '0');
+        return negative ? -value : value;
+    }
+
+    double readDouble()
+    {
+        static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+        if (!more())
+            throw std::runtime_error("Error: Unexpected end of number list.");
+        const char* start = p;
+        bool negative = *p == '-';
+        if (*p == '-' || *p == '+')
+            p++;
+        uint64_t mantissa = 0;
+        int digits = 0, exponent = 0;
+        bool any = false;
+        while (*p >= '0' && *p <= '9') {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                if (mantissa)
+                    digits++;
+            } else {
+                exponent++;
+            }
+            any = true;
+            p++;
+        }
+        if (*p == '.') {
+            p++;
+            while (*p >= '0' && *p <= '9') {
+                if (digits < 19) {
+                    mantissa = mantissa * 10 + (*p - '0');
+                    if (mantissa)
+                        digits++;
+                    exponent--;
+                }
+                any = true;
+                p++;
+            }
+        }
+        if (any && (*p == 'e' || *p == 'E')) {
+            p++;
+            bool negativeExp = *p == '-';
+            if (*p == '-' || *p == '+')
+                p++;
+            int value = 0;
+            while (*p >= '0' && *p <= '9') {
+                if (value < 10000)
+                    value = value * 10 + (*p - '0');
+                p++;
+            }
+            exponent += negativeExp ? -value : value;
+        }
+        if (any && mantissa < (1ULL << 53) && exponent >= -22 && exponent <= 22) {
+            double value = (double)mantissa;
+            value = exponent < 0 ? value / powers[-exponent] : value * powers[exponent];
+            return negative ? -value : value;
+        }
+
+        char* end;
+        double value = strtod(start, &end);
+        if (end == start)
+            throw std::runtime_error("Error: Invalid number in number list.");
+        p = end;
+        return value;
+    }
+};
+
 struct BVHArgs {
     std::vector<parser::Face>& arr;
+    std::vector<parser::Box>& nodes;
     int i;
     int j;
     int level;
-    BVHArgs(std::vector<parser::Face>& arrin, int i, int j, int level)
+    BVHArgs(std::vector<parser::Face>& arrin, std::vector<parser::Box>& nodesin, int i, int j, int level)
         : arr(arrin)
+        , nodes(nodesin)
     {
         this->i = i;
         this->j = j;
@@ -30,13 +149,15 @@ struct BVHArgs {
     }
 };
 
-parser::Box* formBVH(BVHArgs* arg)
+// Appends the subtree for faces [i, j) to nodes and returns the index of its root
+int formBVH(BVHArgs* arg)
 {
     std::vector<parser::Face>& arr = arg->arr;
+    std::vector<parser::Box>& nodes = arg->nodes;
     int i = arg->i;
     int j = arg->j;
     int level = arg->level;
-    parser::Box* ret = new parser::Box;
+    parser::Box ret;
     bool (*sortingfn)(parser::Face&, parser::Face&);
     if (level % 3 == 0)
         sortingfn = &mysortx;
@@ -44,38 +165,103 @@ parser::Box* formBVH(BVHArgs* arg)
         sortingfn = &mysorty;
     else
         sortingfn = &mysortz;
-    ret->left = ret->right = NULL;
-    ret->leftindex = i;
-    ret->rigthindex = j;
-    ret->max.x = 0;
-    ret->max.y = 0;
-    ret->max.z = 0;
-    ret->min.x = __DBL_MAX__;
-    ret->min.y = __DBL_MAX__;
-    ret->min.z = __DBL_MAX__;
+    ret.left = ret.right = -1;
+    ret.leftindex = i;
+    ret.rigthindex = j;
+    ret.max.x = 0;
+    ret.max.y = 0;
+    ret.max.z = 0;
+    ret.min.x = __DBL_MAX__;
+    ret.min.y = __DBL_MAX__;
+    ret.min.z = __DBL_MAX__;
     for (int index = i; index < j; index++) {
-        ret->max.x = MAX(ret->max.x, arr[index].max[0]);
-        ret->max.y = MAX(ret->max.y, arr[index].max[1]);
-        ret->max.z = MAX(ret->max.z, arr[index].max[2]);
-        ret->min.x = MIN(ret->min.x, arr[index].min[0]);
-        ret->min.y = MIN(ret->min.y, arr[index].min[1]);
-        ret->min.z = MIN(ret->min.z, arr[index].min[2]);
+        ret.max.x = MAX(ret.max.x, arr[index].max[0]);
+        ret.max.y = MAX(ret.max.y, arr[index].max[1]);
+        ret.max.z = MAX(ret.max.z, arr[index].max[2]);
+        ret.min.x = MIN(ret.min.x, arr[index].min[0]);
+        ret.min.y = MIN(ret.min.y, arr[index].min[1]);
+        ret.min.z = MIN(ret.min.z, arr[index].min[2]);
     }
+    int self = nodes.size();
+    nodes.push_back(ret);
     if (j - i < 6) {
-        return ret;
+        return self;
     }
     std::sort(arr.begin() + i, arr.begin() + j, sortingfn);
 
     BVHArgs* temp;
-    temp = new BVHArgs(arr, i, (i + j) / 2, level + 1);
-    ret->left = formBVH(temp);
+    temp = new BVHArgs(arr, nodes, i, (i + j) / 2, level + 1);
+    int left = formBVH(temp);
     delete temp;
 
-    temp = new BVHArgs(arr, (i + j) / 2, j, level + 1);
-    ret->right = formBVH(temp);
+    temp = new BVHArgs(arr, nodes, (i + j) / 2, j, level + 1);
+    int right = formBVH(temp);
     delete temp;
 
-    return ret;
+    // children may have reallocated nodes, so index instead of keeping a reference
+    nodes[self].left = left;
+    nodes[self].right = right;
+    return self;
+}
+
+parser::Scene::Scene()
+{
+    environment.face_size = 0;
+    mipmaps = true;
+    min_throughput = 0.5 / 255;
+    light_cutoff = 0.5;
+    light_samples = 0;
+    aa_samples = 0;
+    aa_threshold = 16;
+    subsample = 1;
+    heatmap = false;
+}
+
+parser::Scene::~Scene()
+{
+    for (int i = 0; i < mappings.size(); i++)
+        unmap_file(mappings[i]);
+}
+
+// Resamples the latitude-longitude image, mapped like the texture of a
+// sphere, onto the faces of environment with bilinear filtering
+static void buildEnvironment(parser::EnvironmentMap& environment, TextureImage& image)
+{
+    MipLevel& level = image.levels[0];
+    int size = MAX(1, image.width / 4);
+    environment.face_size = size;
+    environment.texels.resize((size_t)6 * size * size);
+    for (int face = 0; face < 6; face++) {
+        int axis = face / 2;
+        for (int y = 0; y < size; y++) {
+            for (int x = 0; x < size; x++) {
+                double dir[3];
+                dir[axis] = face % 2 ? -1 : 1;
+                dir[(axis + 1) % 3] = (x + 0.5) / size * 2 - 1;
+                dir[(axis + 2) % 3] = (y + 0.5) / size * 2 - 1;
+                double length = sqrt(dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2]);
+                double theta = acos(dir[1] / length);
+                double phi = atan2(dir[2], dir[0]);
+                double u = (M_PI - phi) / (2 * M_PI) * level.width - 0.5;
+                double v = theta / M_PI * level.height - 0.5;
+                int u0 = (int)floor(u), v0 = (int)floor(v);
+                double du = u - u0, dv = v - v0;
+                double color[3] = { 0, 0, 0 };
+                for (int corner = 0; corner < 4; corner++) {
+                    int tu = ((u0 + corner % 2) % level.width + level.width) % level.width; // wraps around in longitude
+                    int tv = MAX(0, MIN(v0 + corner / 2, level.height - 1));
+                    double weight = (corner % 2 ? du : 1 - du) * (corner / 2 ? dv : 1 - dv);
+                    uint32_t texel = level.texels[level.index(tu, tv)];
+                    for (int c = 0; c < 3; c++)
+                        color[c] += weight * ((texel >> (8 * c)) & 0xff);
+                }
+                uint32_t packed = 0xff000000u;
+                for (int c = 0; c < 3; c++)
+                    packed |= (uint32_t)MIN(255, (int)(color[c] + 0.5)) << (8 * c);
+                environment.texels[((size_t)face * size + y) * size + x] = packed;
+            }
+        }
+    }
 }
 
 void parser::Scene::loadFromXml(const std::string& filepath)
@@ -83,7 +269,11 @@ void parser::Scene::loadFromXml(const std::string& filepath)
     tinyxml2::XMLDocument file;
     std::stringstream stream;
 
-    auto res = file.LoadFile(filepath.c_str());
+    tinyxml2::XMLError res;
+    {
+        ScopedTimer timer("xml");
+        res = file.LoadFile(filepath.c_str());
+    }
     if (res) {
         throw std::runtime_error("Error: The xml file cannot be loaded.");
     }
@@ -236,6 +426,7 @@ void parser::Scene::loadFromXml(const std::string& filepath)
         stream >> material.specular.x >> material.specular.y >> material.specular.z;
         stream >> material.mirror.x >> material.mirror.y >> material.mirror.z;
         stream >> material.phong_exponent;
+        material.classify();
 
         materials.push_back(material);
         element = element->NextSiblingElement("Material");
@@ -243,14 +434,16 @@ void parser::Scene::loadFromXml(const std::string& filepath)
 
     //Get VertexData
     element = root->FirstChildElement("VertexData");
-    stream << element->GetText() << std::endl;
+    NumberReader numbers(element->GetText());
+    vertex_data.reserve(vertex_data.size() + numbers.count() / 3);
     Vertex vertex;
-    while (!(stream >> vertex.coordinates.x).eof()) {
-        stream >> vertex.coordinates.y >> vertex.coordinates.z;
+    while (numbers.more()) {
+        vertex.coordinates.x = numbers.readDouble();
+        vertex.coordinates.y = numbers.readDouble();
+        vertex.coordinates.z = numbers.readDouble();
         vertex.u = vertex.v = -1;
         vertex_data.push_back(vertex);
     }
-    stream.clear();
 
     // Get transformations data
     element = root->FirstChildElement("Transformations");
@@ -290,9 +483,11 @@ void parser::Scene::loadFromXml(const std::string& filepath)
     // Get texture data
     element = root->FirstChildElement("Textures");
     if (element) {
+        ScopedTimer timer("textures");
         element = element->FirstChildElement("Texture");
         Texture texture;
         std::string temp;
+        std::vector<std::string> names;
         while (element) {
             auto child = element->FirstChildElement("ImageName");
             stream << child->GetText() << std::endl;
@@ -303,10 +498,10 @@ void parser::Scene::loadFromXml(const std::string& filepath)
             child = element->FirstChildElement("Appearance");
             stream << child->GetText() << std::endl;
 
-            stream >> temp; //get image stuff TODO
-            read_jpeg_header(temp.c_str(), texture.width, texture.height);
-            texture.image = new unsigned char[texture.width * texture.height * 3];
-            read_jpeg(temp.c_str(), texture.image, texture.width, texture.height);
+            stream >> temp; //get image, decoded below once all textures are known
+            names.push_back(temp);
+            texture.width = texture.height = 0;
+            texture.interpolation = texture.colormode = texture.repeatmode = -1; // rejected by texture_sampler
 
             stream >> temp; //get interpolation
             if (!strcmp(temp.c_str(), "bilinear"))
@@ -331,22 +526,67 @@ void parser::Scene::loadFromXml(const std::string& filepath)
             textures.push_back(texture);
             element = element->NextSiblingElement("Texture");
         }
+
+        // Decode all images at once on the worker threads, files already
+        // decoded for a live texture come from the cache. Streamed textures
+        // only read the header of their converted file.
+        std::vector<std::string> errors(names.size());
+        parallel_for(names.size(), [&](int index) {
+            try {
+                Texture& current = textures[index];
+                if (texture_stream_enabled()) {
+                    current.streamed = texture_stream_open(names[index]);
+                    current.width = current.streamed->width;
+                    current.height = current.streamed->height;
+                    for (int l = 0; l < current.streamed->levels.size(); l++) {
+                        MipLevel level;
+                        level.texels = NULL;
+                        level.width = current.streamed->levels[l].width;
+                        level.height = current.streamed->levels[l].height;
+                        level.blocks_per_row = (level.width + TILE_SIZE - 1) / TILE_SIZE;
+                        current.levels.push_back(level);
+                    }
+                } else {
+                    current.data = texture_cache_acquire(names[index]);
+                    current.width = current.data->width;
+                    current.height = current.data->height;
+                    current.levels = current.data->levels;
+                }
+                current.sampler = texture_sampler(current);
+            } catch (std::exception& error) {
+                errors[index] = error.what();
+            }
+        });
+        for (int index = 0; index < errors.size(); index++) {
+            if (!errors[index].empty())
+                throw std::runtime_error(errors[index]);
+        }
+    }
+
+    // Get environment map
+    element = root->FirstChildElement("EnvironmentMap");
+    if (element) {
+        ScopedTimer timer("environment");
+        auto child = element->FirstChildElement("ImageName");
+        if (!child || !child->GetText())
+            throw std::runtime_error("Error: EnvironmentMap needs an ImageName.");
+        std::shared_ptr<TextureImage> image = texture_cache_acquire(child->GetText());
+        buildEnvironment(environment, *image);
     }
 
     // Get texel coordinate data
     element = root->FirstChildElement("TexCoordData");
     if (element) {
-        stream << element->GetText() << std::endl;
+        NumberReader numbers(element->GetText());
         int index = 0;
-        double u;
-        while (!(stream >> u).eof()) {
-            stream >> vertex_data[index].v;
-            vertex_data[index++].u = u;
+        while (numbers.more() && index < vertex_data.size()) {
+            vertex_data[index].u = numbers.readDouble();
+            vertex_data[index++].v = numbers.readDouble();
         }
-        stream.clear();
     }
 
     //Get Meshes
+    ScopedTimer meshTimer("meshes");
     element = root->FirstChildElement("Objects");
     element = element->FirstChildElement("Mesh");
     Mesh mesh;
@@ -391,12 +631,16 @@ void parser::Scene::loadFromXml(const std::string& filepath)
             stream.clear();
         }
 
+        ScopedTimer facesTimer("faces");
         child = element->FirstChildElement("Faces");
-        stream << child->GetText() << std::endl;
+        NumberReader numbers(child->GetText());
+        mesh.faces.reserve(numbers.count() / 3);
         Face face;
         int v0, v1, v2;
-        while (!(stream >> v0).eof()) {
-            stream >> v1 >> v2;
+        while (numbers.more()) {
+            v0 = numbers.readInt();
+            v1 = numbers.readInt();
+            v2 = numbers.readInt();
             face.v0 = vertex_data[v0 - 1];
             face.v1 = vertex_data[v1 - 1];
             face.v2 = vertex_data[v2 - 1];
@@ -415,17 +659,33 @@ void parser::Scene::loadFromXml(const std::string& filepath)
             face.min[2] = MIN(MIN(face.v1.coordinates.z, face.v2.coordinates.z), face.v0.coordinates.z);
             mesh.faces.push_back(face);
         }
-        stream.clear();
-
-        BVHArgs* arg = new BVHArgs(mesh.faces, 0, mesh.faces.size(), 0);
-        mesh.head = formBVH(arg);
-        delete arg;
+        facesTimer.stop();
+
+        ScopedTimer bvhTimer("bvh");
+        MappedFile cached;
+        uint64_t key = 0;
+        if (!bvh_cache_dir.empty())
+            key = bvh_cache_key(mesh.faces, M);
+        if (!bvh_cache_dir.empty() && bvh_cache_load(bvh_cache_dir, key, mesh, cached)) {
+            // faces and nodes are read from the cache file from now on
+            mappings.push_back(cached);
+            std::vector<Face>().swap(mesh.faces);
+        } else {
+            BVHArgs* arg = new BVHArgs(mesh.faces, mesh.bvh, 0, mesh.faces.size(), 0);
+            formBVH(arg);
+            delete arg;
+            if (!bvh_cache_dir.empty())
+                bvh_cache_store(bvh_cache_dir, key, mesh);
+        }
+        bvhTimer.stop();
 
         meshes.push_back(mesh);
         mesh.faces.clear();
+        mesh.bvh.clear();
         element = element->NextSiblingElement("Mesh");
     }
     stream.clear();
+    meshTimer.stop();
 
     //Get Triangles
     element = root->FirstChildElement("Objects");
@@ -575,8 +835,20 @@ void parser::Scene::loadFromXml(const std::string& filepath)
 
             stream.clear();
         }
+        sphere.frame();
 
         spheres.push_back(sphere);
         element = element->NextSiblingElement("Sphere");
     }
+
+    // Meshes are final now, point the renderer at their storage
+    for (int meshID = 0; meshID < meshes.size(); meshID++) {
+        Mesh& current = meshes[meshID];
+        if (current.bvh.empty())
+            continue; // came from the bvh cache
+        current.face_data = current.faces.data();
+        current.face_count = current.faces.size();
+        current.bvh_data = current.bvh.data();
+        current.bvh_count = current.bvh.size();
+    }
 }
@@ -2,6 +2,8 @@
 #define __HW1__PARSER__
 
 #include "jpeg.h"
+#include "mapped.h"
+#include "texstream.h"
 #include <algorithm>
 #include <iostream>
 #include <math.h>
@@ -25,6 +27,9 @@
 #define MESHHIT 8 // for hitType
 #define TRIANGLEHIT 9
 #define SPHEREHIT 10
+#define MATERIAL_DIFFUSE 1 // for Material::features
+#define MATERIAL_SPECULAR 2
+#define MATERIAL_MIRROR 4
 
 #define __DBL_MAX__ double(1.79769313486231570814527423731704357e+308L)
 
@@ -388,6 +393,18 @@ struct Material {
     Vec3f specular;
     Vec3f mirror;
     float phong_exponent;
+    int features; // MATERIAL_* flags of the non-zero terms, picks the shading kernel
+
+    void classify()
+    {
+        features = 0;
+        if (diffuse.x || diffuse.y || diffuse.z)
+            features |= MATERIAL_DIFFUSE;
+        if (specular.x || specular.y || specular.z)
+            features |= MATERIAL_SPECULAR;
+        if (mirror.x || mirror.y || mirror.z)
+            features |= MATERIAL_MIRROR;
+    }
 };
 
 struct Face {
@@ -401,7 +418,7 @@ struct Face {
 
 struct Box {
     Vec3f min, max;
-    Box *left, *right;
+    int left, right; // child node indices, -1 for leaves
     int leftindex, rigthindex;
 };
 
@@ -409,7 +426,11 @@ struct Mesh {
     int material_id;
     int texture_id;
     std::vector<Face> faces;
-    Box* head;
+    std::vector<Box> bvh; // root is at index 0
+    // what the renderer reads, points either into the vectors above or into a mapped file
+    Face* face_data;
+    Box* bvh_data;
+    int face_count, bvh_count;
 };
 
 struct Triangle {
@@ -424,20 +445,55 @@ struct Sphere {
     Vec3f center_vertex;
     Vec3f u, v, w;
     float radius;
+    double to_local[3][4]; // world to the u, v, w frame around the center, set by frame()
+
+    void frame()
+    {
+        matrix M = translate(-center_vertex.x, -center_vertex.y, -center_vertex.z);
+        M = CameraT(u, v, w) * M;
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 4; j++)
+                to_local[i][j] = M.translator[i][j];
+        }
+    }
+    Vec3f local(Vec3f& point)
+    {
+        Vec3f ret;
+        ret.x = to_local[0][0] * point.x + to_local[0][1] * point.y + to_local[0][2] * point.z + to_local[0][3];
+        ret.y = to_local[1][0] * point.x + to_local[1][1] * point.y + to_local[1][2] * point.z + to_local[1][3];
+        ret.z = to_local[2][0] * point.x + to_local[2][1] * point.y + to_local[2][2] * point.z + to_local[2][3];
+        return ret;
+    }
 };
 
+struct Texture;
+
+// Looks a texture up at UV on mip level lod. diffuse gets the diffuse
+// coefficient of a surface whose material has kd, ambient the colour that
+// replaces the whole shading (zero unless the texture replaces all).
+typedef void (*TextureSampler)(Vec2f UV, Texture& texture, double lod, const Vec3f& kd, double* diffuse, double* ambient);
+
 struct Texture {
     int interpolation;
     int colormode;
     int repeatmode;
-    //another element for image itself but do not know its format for now
-    unsigned char* image;
     int width, height;
-    // texture data is cleared during pushback so delete it at the end of the program
-    /*~Texture()
-    {
-        delete[] image;
-    }*/
+    std::vector<MipLevel> levels; // levels[0] is full size
+    // owner of the texels, shared through the texture cache; empty when they lie in a mapped file
+    std::shared_ptr<TextureImage> data;
+    // set instead of data when texels are paged in on demand, levels then only carry sizes
+    std::shared_ptr<StreamedTexture> streamed;
+    TextureSampler sampler; // specialised for the modes above, set by the loaders
+};
+
+// Sky seen by rays that miss every object. The latitude-longitude image is
+// resampled at load onto the six faces of a cube around the origin, so a
+// lookup only picks a face and divides, without trigonometry.
+struct EnvironmentMap {
+    int face_size; // texels per side of a face, 0 when the scene has no map
+    // RGBA texels like MipLevel, face after face in the order +x, -x, +y, -y, +z, -z,
+    // each row-major. On the face of axis a, x runs along axis (a + 1) % 3 and y along (a + 2) % 3.
+    std::vector<uint32_t> texels;
 };
 
 struct Scene {
@@ -457,9 +513,27 @@ struct Scene {
     std::vector<Triangle> triangles;
     std::vector<Sphere> spheres;
     std::vector<Texture> textures;
+    EnvironmentMap environment;
+    std::vector<MappedFile> mappings; // files the scene data points into
+    std::string bvh_cache_dir; // where built mesh BVHs are kept between runs, empty to disable
+
+    //Render settings, set from the command line
+    bool mipmaps; // pick texture levels from ray differentials
+    double min_throughput; // mirror paths whose weight falls below this are not followed further
+    double light_cutoff; // 8-bit levels the lights skipped at a hit may add up to
+    int light_samples; // lights sampled per hit when there are more, 0 to shade all
+    int aa_samples; // extra samples for pixels on edges, 0 for one sample per pixel
+    int aa_threshold; // 8-bit levels neighbours may differ by before they count as an edge
+    int subsample; // spacing of the traced pixels in uniform areas, 1 to trace all
+    bool heatmap; // write the traversal cost of every pixel next to the images, needs RT_COUNTERS
 
     //Functions
+    Scene();
+    ~Scene();
     void loadFromXml(const std::string& filepath);
+    // Binary snapshot of the processed scene, see compiled.cpp
+    void saveCompiled(const std::string& filepath);
+    void loadCompiled(const std::string& filepath);
 };
 }
 
@@ -0,0 +1,42 @@
+#include "pool.h"
+#include "timer.h"
+#include <atomic>
+#include <thread>
+#include <vector>
+
+static int workers = 0;
+
+int worker_count()
+{
+    if (workers > 0)
+        return workers;
+    int hardware = std::thread::hardware_concurrency();
+    return hardware > 0 ? hardware : 1;
+}
+
+void set_worker_count(int count)
+{
+    workers = count;
+}
+
+void parallel_for(int count, const std::function<void(int)>& fn)
+{
+    std::atomic<int> next(0);
+    TimerNode* phase = timer_current();
+    auto run = [&]() {
+        timer_set_current(phase); // workers time their work inside the caller's phase
+        int index;
+        while ((index = next++) < count)
+            fn(index);
+    };
+
+    int threadCount = worker_count();
+    if (threadCount > count)
+        threadCount = count;
+    std::vector<std::thread> threads;
+    for (int i = 1; i < threadCount; i++)
+        threads.push_back(std::thread(run));
+    run();
+    for (auto& thread : threads)
+        thread.join();
+}
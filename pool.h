@@ -0,0 +1,14 @@
+#ifndef __pool_h__
+#define __pool_h__
+
+#include <functional>
+
+// Number of threads used by parallel_for, defaults to the hardware concurrency
+int worker_count();
+void set_worker_count(int count);
+
+// Calls fn(index) for every index in [0, count), indices are handed out
+// dynamically so expensive items do not stall the other threads
+void parallel_for(int count, const std::function<void(int)>& fn);
+
+#endif // __pool_h__
@@ -37,3 +37,38 @@ void write_ppm(const char* filename, unsigned char* data, int width, int height)
 
     (void) fclose(outfile);
 }
+
+FILE* ppm_stream_open(const char* filename, int width, int height)
+{
+    FILE *outfile;
+
+    if ((outfile = fopen(filename, "wb")) == NULL) 
+    {
+        throw std::runtime_error("Error: The ppm file cannot be opened for writing.");
+    }
+
+    (void) fprintf(outfile, "P6\n%d %d\n255\n", width, height);
+    return outfile;
+}
+
+void ppm_stream_write(FILE* outfile, const unsigned char* rows, int width, int count)
+{
+    size_t size = (size_t)width * count * 3;
+    if (fwrite(rows, 1, size, outfile) != size)
+    {
+        throw std::runtime_error("Error: The ppm file cannot be written.");
+    }
+}
+
+void ppm_stream_close(FILE* outfile)
+{
+    if (fclose(outfile) != 0)
+    {
+        throw std::runtime_error("Error: The ppm file cannot be written.");
+    }
+}
+
+void ppm_stream_abort(FILE* outfile)
+{
+    (void) fclose(outfile);
+}
@@ -1,6 +1,16 @@
 #ifndef __ppm_h__
 #define __ppm_h__
 
+#include <cstdio>
+
 void write_ppm(const char* filename, unsigned char* data, int width, int height);
 
+// Binary (P6) writer that takes the image a few rows at a time
+FILE* ppm_stream_open(const char* filename, int width, int height);
+void ppm_stream_write(FILE* outfile, const unsigned char* rows, int width, int count);
+// Flushes and closes the file, throws when the last rows cannot be written
+void ppm_stream_close(FILE* outfile);
+// Gives up on an unfinished image, the rows written so far stay in the file
+void ppm_stream_abort(FILE* outfile);
+
 #endif // __ppm_h__
@@ -1,18 +1,36 @@
 #include "parser.h"
+#include "pool.h"
 #include "ppm.h"
+#include "timer.h"
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <cstring>
 #include <math.h>
+#include <mutex>
 #include <pthread.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 #include <thread>
+#include <unistd.h>
 
 using namespace parser;
 
 typedef unsigned char RGB[3];
 
 #define clip(a) MIN(round(a), 255)
+#define BLOCK_ROWS 16 // rows handed to a thread at once
 
 struct Ray {
     Vec3f start, dir;
+    // ray differentials, change of start and dir for a one pixel step right (x) and down (y)
+    bool hasDifferentials;
+    Vec3f dOx, dOy, dDx, dDy;
+    Ray()
+    {
+        hasDifferentials = false;
+    }
 };
 
 struct Hit {
@@ -24,10 +42,41 @@ struct Hit {
     bool replace_all_drawn; //needed for replace all
     Vec3f intersectPoint, normal;
     double t;
+    bool hasDifferentials; // dPdx and dPdy are valid
+    Vec3f dPdx, dPdy; // change of intersectPoint for a one pixel step
 };
 
+// Intersection counters, compiled in by building with -DRT_COUNTERS (make
+// counters). Every thread counts into its own copy, FlushCounters merges
+// them into the totals when a row block is done.
+#ifdef RT_COUNTERS
+#define COUNT(counter, n) ((counter) += (n))
+
+struct TraversalCounters {
+    long boxTests, triangleTests, sphereTests;
+    long leaves, leafDepth; // BVH leaves reached and the sum of their depths
+};
+
+static thread_local TraversalCounters traversal;
+#else
+#define COUNT(counter, n)
+#endif
+
+#ifdef RT_COUNTERS
+// Cost of every pixel of the image being rendered with --heatmap, summed over its samples
+struct Heatmap {
+    std::vector<uint32_t> nodes, primitives, shadows;
+};
+
+static Heatmap* heatmap = NULL;
+// Rows of the block the thread renders. Neighbour rows traced for
+// antialiasing belong to another thread and are not added to the heatmap.
+static thread_local int heatmapRows[2];
+#endif
+
 bool ray_box_intersect(Ray& ray, Box& box)
 {
+    COUNT(traversal.boxTests, 1);
     double minx, miny, minz;
     double maxx, maxy, maxz;
     minx = MIN((box.min.x - ray.start.x) / ray.dir.x, (box.max.x - ray.start.x) / ray.dir.x);
@@ -46,6 +95,7 @@ bool ray_box_intersect(Ray& ray, Box& box)
 
 double ray_triangle_intersect(Ray& ray, Face& triangle, Scene& scene)
 {
+    COUNT(traversal.triangleTests, 1);
 #define e (ray.start)
 #define d (ray.dir)
 #define a (triangle.v0.coordinates)
@@ -73,6 +123,7 @@ double ray_triangle_intersect(Ray& ray, Face& triangle, Scene& scene)
 
 double ray_sphere_intersect(Ray& ray, Sphere& sphere, Scene& scene)
 {
+    COUNT(traversal.sphereTests, 1);
 
 #define r (sphere.radius)
 #define c (sphere.center_vertex)
@@ -100,18 +151,67 @@ double ray_sphere_intersect(Ray& ray, Sphere& sphere, Scene& scene)
     return -1;
 }
 
-Ray Generate(Camera& camera, int i, int j)
+// Ray through the point (dx, dy) of pixel (i, j), both in [0, 1], the centre by default
+Ray Generate(Camera& camera, int i, int j, double dx = 0.5, double dy = 0.5)
 {
     Vec3f current;
     Ray ret;
 
-    current = camera.topleft + camera.halfpixelD * (2 * i + 1) + camera.halfpixelR * (2 * j + 1);
+    current = camera.topleft + camera.halfpixelD * (2 * (i + dy)) + camera.halfpixelR * (2 * (j + dx));
 
     ret.dir = current - camera.position;
     ret.start = camera.position;
+
+    ret.hasDifferentials = true;
+    ret.dOx.x = ret.dOx.y = ret.dOx.z = 0;
+    ret.dOy = ret.dOx;
+    ret.dDx = camera.halfpixelR * 2;
+    ret.dDy = camera.halfpixelD * 2;
     return ret;
 }
 
+// Moves the differentials of ray to the hit point on the tangent plane
+void TransferDifferentials(Ray& ray, Hit& hit)
+{
+    double dn = ray.dir.dot(hit.normal);
+    hit.hasDifferentials = ray.hasDifferentials && dn != 0;
+    if (!hit.hasDifferentials)
+        return;
+    Vec3f dx = ray.dOx + ray.dDx * hit.t;
+    Vec3f dy = ray.dOy + ray.dDy * hit.t;
+    hit.dPdx = dx - ray.dir * (dx.dot(hit.normal) / dn);
+    hit.dPdy = dy - ray.dir * (dy.dot(hit.normal) / dn);
+}
+
+// Differentials of the mirror ray dir = 2 (n.v) n - v, where v = -ray.dir / |ray.dir|
+void ReflectDifferentials(Ray& ray, Hit& hit, Scene& scene, Ray& reflected)
+{
+    reflected.hasDifferentials = hit.hasDifferentials;
+    if (!hit.hasDifferentials)
+        return;
+    Vec3f zero = { 0, 0, 0 };
+    Vec3f dNx = zero, dNy = zero;
+    if (hit.hitType == SPHEREHIT) {
+        // the normal of a sphere moves with the point
+        dNx = hit.dPdx * (1.0 / scene.spheres[hit.hitID].radius);
+        dNy = hit.dPdy * (1.0 / scene.spheres[hit.hitID].radius);
+    }
+    double len = sqrt(ray.dir.dot(ray.dir));
+    Vec3f v = ray.dir * (-1 / len);
+    double nv = hit.normal.dot(v);
+
+    Vec3f* dD[2] = { &ray.dDx, &ray.dDy };
+    Vec3f* dN[2] = { &dNx, &dNy };
+    Vec3f* out[2] = { &reflected.dDx, &reflected.dDy };
+    for (int k = 0; k < 2; k++) {
+        Vec3f dv = (*dD[k] * (1 / len) - ray.dir * (ray.dir.dot(*dD[k]) / (len * len * len))) * -1;
+        double dnv = dN[k]->dot(v) + hit.normal.dot(dv);
+        *out[k] = hit.normal * (2 * dnv) + *dN[k] * (2 * nv) - dv;
+    }
+    reflected.dOx = hit.dPdx;
+    reflected.dOy = hit.dPdy;
+}
+
 Hit* ClosestHitInBox(Ray& ray, Box* box, Mesh& mesh, Scene& scene)
 {
     if (box == NULL)
@@ -120,7 +220,7 @@ Hit* ClosestHitInBox(Ray& ray, Box* box, Mesh& mesh, Scene& scene)
     double t, tmin = __DBL_MAX__;
     ret->hitOccur = false;
     for (int faceID = box->leftindex; faceID < box->rigthindex; faceID++) {
-        Face& triangle = mesh.faces[faceID];
+        Face& triangle = mesh.face_data[faceID];
         t = ray_triangle_intersect(ray, triangle, scene);
         if (t >= 0 && t < tmin) {
             tmin = t;
@@ -140,20 +240,23 @@ Hit* ClosestHitInBox(Ray& ray, Box* box, Mesh& mesh, Scene& scene)
     return NULL;
 }
 
-Hit* meshBVH(Ray& ray, Box* box, Mesh& mesh, Scene& scene)
+Hit* meshBVH(Ray& ray, int node, Mesh& mesh, Scene& scene, int depth = 0)
 {
     Hit *retl, *retr;
     double tmin = __DBL_MAX__;
-    if (!box)
+    if (node < 0 || node >= mesh.bvh_count)
         return NULL;
+    Box* box = &mesh.bvh_data[node];
     if (!ray_box_intersect(ray, *box))
         return NULL;
 
-    if (box->left == NULL && box->right == NULL) {
+    if (box->left < 0 && box->right < 0) {
+        COUNT(traversal.leaves, 1);
+        COUNT(traversal.leafDepth, depth);
         return ClosestHitInBox(ray, box, mesh, scene);
     }
-    retl = meshBVH(ray, box->left, mesh, scene);
-    retr = meshBVH(ray, box->right, mesh, scene);
+    retl = meshBVH(ray, box->left, mesh, scene, depth + 1);
+    retr = meshBVH(ray, box->right, mesh, scene, depth + 1);
     if (!retl)
         return retr;
     if (!retr)
@@ -171,11 +274,12 @@ Hit ClosestHit(Ray& ray, Scene& scene)
     Hit ret;
     double t, tmin = __DBL_MAX__;
     ret.hitOccur = false;
+    ret.hasDifferentials = false;
     // Intersection tests
     //  Mesh intersect
     for (int meshID = 0; meshID < scene.meshes.size(); meshID++) {
         Mesh& mesh = scene.meshes[meshID];
-        Hit* meshHit = meshBVH(ray, mesh.head, mesh, scene);
+        Hit* meshHit = meshBVH(ray, 0, mesh, scene);
         if (meshHit) {
             if (meshHit->t < tmin) {
                 ret = *meshHit;
@@ -220,23 +324,7 @@ Hit ClosestHit(Ray& ray, Scene& scene)
     return ret;
 }
 
-double* Specular(Ray& ray, Hit& hit, PointLight& light, Scene& scene)
-{
-    Vec3f toSource, halfWay, toLight;
-    toSource = (ray.start - hit.intersectPoint).normalize();
-    toLight = (light.position - hit.intersectPoint);
-    double dSquare = toLight.dot(toLight);
-    toLight = toLight.normalize();
-    halfWay = (toSource + toLight).normalize();
-    double* ret = new double[3];
-    double temp = halfWay.dot(hit.normal);
-    ret[0] = scene.materials[hit.materialID - 1].specular.x * pow(temp, scene.materials[hit.materialID - 1].phong_exponent) * light.intensity.x / dSquare;
-    ret[1] = scene.materials[hit.materialID - 1].specular.y * pow(temp, scene.materials[hit.materialID - 1].phong_exponent) * light.intensity.y / dSquare;
-    ret[2] = scene.materials[hit.materialID - 1].specular.z * pow(temp, scene.materials[hit.materialID - 1].phong_exponent) * light.intensity.z / dSquare;
-    return ret;
-}
-
-Vec2f* uvForTriangle(Ray& ray, Face& triangle)
+Vec2f uvForTriangle(Ray& ray, Face& triangle)
 {
 #define e (ray.start)
 #define d (ray.dir)
@@ -253,153 +341,167 @@ Vec2f* uvForTriangle(Ray& ray, Face& triangle)
 #undef a
 #undef b
 #undef c
-    Vec2f* ret = new Vec2f();
-    ret->x = (1 - beta - gamma) * triangle.v0.u + beta * triangle.v1.u + gamma * triangle.v2.u;
-    ret->y = (1 - beta - gamma) * triangle.v0.v + beta * triangle.v1.v + gamma * triangle.v2.v;
+    Vec2f ret;
+    ret.x = (1 - beta - gamma) * triangle.v0.u + beta * triangle.v1.u + gamma * triangle.v2.u;
+    ret.y = (1 - beta - gamma) * triangle.v0.v + beta * triangle.v1.v + gamma * triangle.v2.v;
     return ret;
 }
 
-Vec2f* uvForSphere(Hit& hit, Sphere& sphere)
+Vec2f uvForSphere(Hit& hit, Sphere& sphere)
 {
-    // need matrix multiplication for uvw coordinate system transformation
-    matrix M = translate(-sphere.center_vertex.x, -sphere.center_vertex.y, -sphere.center_vertex.z);
-    M = CameraT(sphere.u, sphere.v, sphere.w) * M;
-    Vec3f hitCoor = hit.intersectPoint * M; //coordinates of hit after coordinate system transformation
+    Vec3f hitCoor = sphere.local(hit.intersectPoint); //coordinates of hit in the frame of the sphere
     double theta = acos(hitCoor.y / sphere.radius);
     double phi = atan2(hitCoor.z, hitCoor.x);
-    Vec2f* ret = new Vec2f();
-    ret->x = (M_PI - phi) / (2 * M_PI);
-    ret->y = theta / M_PI;
+    Vec2f ret;
+    ret.x = (M_PI - phi) / (2 * M_PI);
+    ret.y = theta / M_PI;
     return ret;
 }
 
-double* ColorTexture(Vec2f& UV, Texture& texture)
+Vec2f uvForTrianglePoint(Face& triangle, Vec3f& point)
 {
-    if (texture.repeatmode == REPEAT) {
-        UV.x = UV.x - (int)UV.x;
-        UV.y = UV.y - (int)UV.y;
-    } else if (texture.repeatmode == CLAMP) {
-        UV.x = MIN(UV.x, 1);
-        UV.y = MIN(UV.y, 1);
-    } else {
-        throw - 1.0;
-    }
-    double* ret = new double[3];
-    int pixelx, pixely;
-    pixelx = ROUND(UV.x * texture.width);
-    pixely = ROUND(UV.y * texture.height);
-
-#define PIXEL(x, y) (3 * ((y)*texture.width + (x)))
-    if (texture.interpolation == NEAREST) {
-        ret[0] = texture.image[PIXEL(pixelx, pixely)];
-        ret[1] = texture.image[PIXEL(pixelx, pixely) + 1];
-        ret[2] = texture.image[PIXEL(pixelx, pixely) + 2];
-    } else if (texture.interpolation == BILINEAR) {
-        double dx = UV.x * texture.width - pixelx;
-        double dy = UV.y * texture.height - pixely;
-        ret[0] = dx * dy * texture.image[PIXEL(pixelx + 1, pixely + 1)]
-            + (1 - dx) * dy * texture.image[PIXEL(pixelx, pixely + 1)]
-            + dx * (1 - dy) * texture.image[PIXEL(pixelx + 1, pixely)]
-            + (1 - dx) * (1 - dy) * texture.image[PIXEL(pixelx, pixely)];
-        ret[1] = dx * dy * texture.image[PIXEL(pixelx + 1, pixely + 1) + 1]
-            + (1 - dx) * dy * texture.image[PIXEL(pixelx, pixely + 1) + 1]
-            + dx * (1 - dy) * texture.image[PIXEL(pixelx + 1, pixely) + 1]
-            + (1 - dx) * (1 - dy) * texture.image[PIXEL(pixelx, pixely) + 1];
-        ret[2] = dx * dy * texture.image[PIXEL(pixelx + 1, pixely + 1) + 2]
-            + (1 - dx) * dy * texture.image[PIXEL(pixelx, pixely + 1) + 2]
-            + dx * (1 - dy) * texture.image[PIXEL(pixelx + 1, pixely) + 2]
-            + (1 - dx) * (1 - dy) * texture.image[PIXEL(pixelx, pixely) + 2];
-    } else {
-        throw true;
-    }
+    // barycentric coordinates of a point on the plane of the triangle
+    Vec3f e0 = triangle.v1 - triangle.v0;
+    Vec3f e1 = triangle.v2 - triangle.v0;
+    Vec3f ep = point - triangle.v0.coordinates;
+    double d00 = e0.dot(e0), d01 = e0.dot(e1), d11 = e1.dot(e1);
+    double d20 = ep.dot(e0), d21 = ep.dot(e1);
+    double denom = d00 * d11 - d01 * d01;
+    double beta = (d11 * d20 - d01 * d21) / denom;
+    double gamma = (d00 * d21 - d01 * d20) / denom;
+    Vec2f ret;
+    ret.x = (1 - beta - gamma) * triangle.v0.u + beta * triangle.v1.u + gamma * triangle.v2.u;
+    ret.y = (1 - beta - gamma) * triangle.v0.v + beta * triangle.v1.v + gamma * triangle.v2.v;
     return ret;
-#undef PIXEL
 }
 
-double* Diffuse(Ray& ray, Hit& hit, PointLight* light, Scene& scene)
+Vec2f uvForSpherePoint(Vec3f& point, Sphere& sphere)
 {
-    Vec3f toSource, toLight;
-    Texture* texture = NULL;
-    double* ret = NULL;
-    Vec2f* UV;
-    double dSquare, temp;
-    if (hit.hitType == MESHHIT) {
-        if (scene.meshes[hit.hitID].texture_id != -1) {
-            texture = &scene.textures[scene.meshes[hit.hitID].texture_id - 1];
-            UV = uvForTriangle(ray, scene.meshes[hit.hitID].faces[hit.faceID]);
-        }
-    } else if (hit.hitType == TRIANGLEHIT) {
-        if (scene.triangles[hit.hitID].texture_id != -1) {
-            texture = &scene.textures[scene.triangles[hit.hitID].texture_id - 1];
-            UV = uvForTriangle(ray, scene.triangles[hit.hitID].indices);
-        }
-    } else if (hit.hitType == SPHEREHIT) {
-        if (scene.spheres[hit.hitID].texture_id != -1) {
-            texture = &scene.textures[scene.spheres[hit.hitID].texture_id - 1];
-            UV = uvForSphere(hit, scene.spheres[hit.hitID]);
-        }
+    Vec3f local = sphere.local(point);
+    // points of the tangent plane are slightly off the sphere
+    double theta = acos(MAX(-1, MIN(1, local.y / sqrt(local.dot(local)))));
+    double phi = atan2(local.z, local.x);
+    Vec2f ret;
+    ret.x = (M_PI - phi) / (2 * M_PI);
+    ret.y = theta / M_PI;
+    return ret;
+}
+
+// log2 of the number of level 0 texels one pixel covers around UV
+double TextureLod(Hit& hit, Vec2f& UV, Texture& texture, Scene& scene)
+{
+    Vec3f px = hit.intersectPoint + hit.dPdx;
+    Vec3f py = hit.intersectPoint + hit.dPdy;
+    Vec2f uvx, uvy;
+    if (hit.hitType == SPHEREHIT) {
+        uvx = uvForSpherePoint(px, scene.spheres[hit.hitID]);
+        uvy = uvForSpherePoint(py, scene.spheres[hit.hitID]);
     } else {
-        throw 'a';
-    }
-    if (texture) {
-        ret = ColorTexture(*UV, *texture);
-        if (light == NULL) {
-            if (texture->colormode == REPLACE_ALL) {
-                return ret;
-            } else {
-                ret[0] = 0;
-                ret[1] = 0;
-                ret[2] = 0;
-                return ret;
-            }
-        }
-        ret[0] = ret[0] / 255;
-        ret[1] = ret[1] / 255;
-        ret[2] = ret[2] / 255;
-        if (texture->colormode == REPLACE_ALL) {
-            ret[0] = 0;
-            ret[1] = 0;
-            ret[2] = 0;
-            return ret;
-        }
-        if (texture->colormode == REPLACE_KD) {
-            // Do nothing we already use ret as diffuse coef
-        } else if (texture->colormode == BLEND_KD) {
-            ret[0] = (ret[0] + scene.materials[hit.materialID - 1].diffuse.x) / 2;
-            ret[1] = (ret[1] + scene.materials[hit.materialID - 1].diffuse.y) / 2;
-            ret[2] = (ret[2] + scene.materials[hit.materialID - 1].diffuse.z) / 2;
-        } else {
-            throw - 1;
-        }
+        Face& face = hit.hitType == MESHHIT ? scene.meshes[hit.hitID].face_data[hit.faceID] : scene.triangles[hit.hitID].indices;
+        uvx = uvForTrianglePoint(face, px);
+        uvy = uvForTrianglePoint(face, py);
     }
-    if (light == NULL) {
-        if (!ret)
-            ret = new double[3];
-        ret[0] = 0;
-        ret[1] = 0;
-        ret[2] = 0;
-        return ret;
+    double dux = uvx.x - UV.x, dvx = uvx.y - UV.y;
+    double duy = uvy.x - UV.x, dvy = uvy.y - UV.y;
+    if (hit.hitType == SPHEREHIT) {
+        // do not count the jump across the u = 0 / 1 seam
+        dux -= round(dux);
+        duy -= round(duy);
     }
-    if (!ret) {
-        ret = new double[3];
-        ret[0] = scene.materials[hit.materialID - 1].diffuse.x;
-        ret[1] = scene.materials[hit.materialID - 1].diffuse.y;
-        ret[2] = scene.materials[hit.materialID - 1].diffuse.z;
+    dux *= texture.width;
+    duy *= texture.width;
+    dvx *= texture.height;
+    dvy *= texture.height;
+    double footprint = MAX(dux * dux + dvx * dvx, duy * duy + dvy * dvy);
+    return footprint > 1 ? 0.5 * log2(footprint) : 0;
+}
+
+int TextureID(Hit& hit, Scene& scene)
+{
+    if (hit.hitType == MESHHIT)
+        return scene.meshes[hit.hitID].texture_id;
+    if (hit.hitType == TRIANGLEHIT)
+        return scene.triangles[hit.hitID].texture_id;
+    return scene.spheres[hit.hitID].texture_id;
+}
+
+// Shading inputs of one hit, fetched once before the lights are visited
+struct Surface {
+    Material* material;
+    Texture* texture; // NULL if the object has none
+    Vec2f uv;
+    double kd[3]; // diffuse coefficient, after the texture is applied
+    double replaced[3]; // colour of a texture replacing all of the shading, else zero
+    Vec3f toSource;
+};
+
+void FetchSurface(Ray& ray, Hit& hit, Scene& scene, Surface& surface)
+{
+    surface.material = &scene.materials[hit.materialID - 1];
+    surface.toSource = (ray.start - hit.intersectPoint).normalize();
+    int textureID = TextureID(hit, scene);
+    if (textureID == -1) {
+        surface.texture = NULL;
+        surface.kd[0] = surface.material->diffuse.x;
+        surface.kd[1] = surface.material->diffuse.y;
+        surface.kd[2] = surface.material->diffuse.z;
+        surface.replaced[0] = surface.replaced[1] = surface.replaced[2] = 0;
+        return;
     }
+    surface.texture = &scene.textures[textureID - 1];
+    if (hit.hitType == MESHHIT)
+        surface.uv = uvForTriangle(ray, scene.meshes[hit.hitID].face_data[hit.faceID]);
+    else if (hit.hitType == TRIANGLEHIT)
+        surface.uv = uvForTriangle(ray, scene.triangles[hit.hitID].indices);
+    else
+        surface.uv = uvForSphere(hit, scene.spheres[hit.hitID]);
+    double lod = 0;
+    if (scene.mipmaps && hit.hasDifferentials)
+        lod = TextureLod(hit, surface.uv, *surface.texture, scene);
+    surface.texture->sampler(surface.uv, *surface.texture, lod, surface.material->diffuse, surface.kd, surface.replaced);
+}
 
-    toLight = (light->position - hit.intersectPoint);
-    dSquare = toLight.dot(toLight);
-    toLight = toLight.normalize();
-    temp = MAX(toLight.dot(hit.normal), 0);
+// BRDF terms of one light, toLight is normalized and dSquare its squared distance
 
-    ret[0] = ret[0] * temp * (light->intensity.x / dSquare);
-    ret[1] = ret[1] * temp * (light->intensity.y / dSquare);
-    ret[2] = ret[2] * temp * (light->intensity.z / dSquare);
+void Specular(Hit& hit, Surface& surface, PointLight& light, Vec3f& toLight, double dSquare, Vec3f& color)
+{
+    Vec3f halfWay = (surface.toSource + toLight).normalize();
+    double temp = halfWay.dot(hit.normal);
+    Material& material = *surface.material;
+    color.x = color.x + material.specular.x * pow(temp, material.phong_exponent) * light.intensity.x / dSquare;
+    color.y = color.y + material.specular.y * pow(temp, material.phong_exponent) * light.intensity.y / dSquare;
+    color.z = color.z + material.specular.z * pow(temp, material.phong_exponent) * light.intensity.z / dSquare;
+}
 
-    return ret;
+void Diffuse(Hit& hit, Surface& surface, PointLight& light, Vec3f& toLight, double dSquare, Vec3f& color)
+{
+    double temp = MAX(toLight.dot(hit.normal), 0);
+    color.x = color.x + surface.kd[0] * temp * (light.intensity.x / dSquare);
+    color.y = color.y + surface.kd[1] * temp * (light.intensity.y / dSquare);
+    color.z = color.z + surface.kd[2] * temp * (light.intensity.z / dSquare);
+}
+
+// Primitive that blocked a light last, the next shadow ray to the light tests it first
+struct Occluder {
+    int hitType; // 0 while there is none
+    int hitID, faceID;
+};
+
+static thread_local std::vector<Occluder> occluders; // per light, reset for every row block
+static thread_local long occluderTests = 0, occluderHits = 0;
+static thread_local long shadowRays = 0;
+
+// Distance along ray to the occluder, negative if it is missed
+double OccluderDistance(Ray& ray, Occluder& occluder, Scene& scene)
+{
+    if (occluder.hitType == MESHHIT)
+        return ray_triangle_intersect(ray, scene.meshes[occluder.hitID].face_data[occluder.faceID], scene);
+    if (occluder.hitType == TRIANGLEHIT)
+        return ray_triangle_intersect(ray, scene.triangles[occluder.hitID].indices, scene);
+    return ray_sphere_intersect(ray, scene.spheres[occluder.hitID], scene);
 }
 
-bool isShadow(Hit& hit, PointLight& light, Scene& scene)
+bool isShadow(Hit& hit, int lightNo, PointLight& light, Scene& scene)
 {
     Vec3f toLight;
     Vec3f toShadow;
@@ -408,157 +510,1148 @@ bool isShadow(Hit& hit, PointLight& light, Scene& scene)
     newRay.dir = toLight;
     newRay.start = hit.intersectPoint + hit.normal * scene.shadow_ray_epsilon;
     double d = toLight.dot(toLight);
+    shadowRays++;
+
+    Occluder& occluder = occluders[lightNo];
+    if (occluder.hitType) {
+        occluderTests++;
+        double t = OccluderDistance(newRay, occluder, scene);
+        if (t >= 0) {
+            toShadow = (newRay.start + newRay.dir * t - hit.intersectPoint);
+            if (toShadow.dot(toShadow) < d) {
+                occluderHits++;
+                return true;
+            }
+        }
+    }
+
     Hit hitsh = ClosestHit(newRay, scene);
     if (hitsh.hitOccur) {
         toShadow = (hitsh.intersectPoint - hit.intersectPoint);
         double ds = toShadow.dot(toShadow);
-        if (ds < d)
+        if (ds < d) {
+            occluder.hitType = hitsh.hitType;
+            occluder.hitID = hitsh.hitID;
+            occluder.faceID = hitsh.faceID;
             return true;
-        else
-            return false;
-    } else
-        return false;
+        }
+    }
+    // the next ray to the light is likely lit as well, do not spend a test on it
+    occluder.hitType = 0;
+    return false;
 }
 
-unsigned char* CalculateColor(Ray& ray, int iterationCount, Scene& scene)
+static thread_local long lightsCulled = 0; // lights skipped without a shadow ray
+static thread_local std::vector<double> lightBounds; // running sum of the bounds for light sampling
+static thread_local uint32_t lightRandom = 1; // xorshift state, reseeded for every pixel
+
+static double NextRandom()
 {
-    Vec3f color = { 0, 0, 0 };
-    unsigned char* ret = new unsigned char[3];
-    ret[0] = ret[1] = ret[2] = 0;
-    if (iterationCount < 0)
-        return ret;
-    Hit hit = ClosestHit(ray, scene);
-    if (!hit.hitOccur) {
-        color.x = clip(scene.background_color.x);
-        color.y = clip(scene.background_color.y);
-        color.z = clip(scene.background_color.z);
-        ret[0] = color.x;
-        ret[1] = color.y;
-        ret[2] = color.z;
-        return ret;
-    }
+    lightRandom ^= lightRandom << 13;
+    lightRandom ^= lightRandom >> 17;
+    lightRandom ^= lightRandom << 5;
+    return lightRandom / 4294967296.0;
+}
+
+// Upper bound, in 8-bit levels, of what light can add to the hit: the
+// specular factor is at most 1 and the diffuse one the cosine.
+template <bool HasDiffuse, bool HasSpecular>
+double LightBound(Hit& hit, Surface& surface, PointLight& light, Vec3f& toLight, double dSquare)
+{
+    double bound = 0;
+    if (HasDiffuse)
+        bound += MAX(surface.kd[0], MAX(surface.kd[1], surface.kd[2])) * MAX(toLight.dot(hit.normal), 0);
+    if (HasSpecular)
+        bound += MAX(surface.material->specular.x, MAX(surface.material->specular.y, surface.material->specular.z));
+    return bound * MAX(light.intensity.x, MAX(light.intensity.y, light.intensity.z)) / dSquare;
+}
+
+// Adds the terms of one light, toLight and dSquare as for LightBound
+template <bool HasDiffuse, bool HasSpecular>
+void Light(Hit& hit, Surface& surface, PointLight& light, Vec3f& toLight, double dSquare, Vec3f& color)
+{
+    if (HasSpecular)
+        Specular(hit, surface, light, toLight, dSquare, color);
+    if (HasDiffuse)
+        Diffuse(hit, surface, light, toLight, dSquare, color);
+}
+
+// Shading of one hit with the terms a material lacks compiled out. Without
+// diffuse and specular terms no shadow rays are cast. weight is the largest
+// channel of the mirror coefficients the hit is seen through. Returns whether
+// the surface reflects, reflected is then the mirror ray.
+template <bool HasDiffuse, bool HasSpecular, bool HasMirror>
+bool Shade(Ray& ray, Hit& hit, Surface& surface, double weight, Scene& scene, Vec3f& color, Ray& reflected)
+{
+    Material& material = *surface.material;
     // Ambient color
-    color.x = color.x + scene.materials[hit.materialID - 1].ambient.x * scene.ambient_light.x;
-    color.y = color.y + scene.materials[hit.materialID - 1].ambient.y * scene.ambient_light.y;
-    color.z = color.z + scene.materials[hit.materialID - 1].ambient.z * scene.ambient_light.z;
-
-    // Calculate shadow for all light
-    double* diffuse = Diffuse(ray, hit, NULL, scene);
-    color.x = (color.x + diffuse[0]);
-    color.y = (color.y + diffuse[1]);
-    color.z = (color.z + diffuse[2]);
-    for (int lightNo = 0; lightNo < scene.point_lights.size(); lightNo++) {
+    color.x = color.x + material.ambient.x * scene.ambient_light.x;
+    color.y = color.y + material.ambient.y * scene.ambient_light.y;
+    color.z = color.z + material.ambient.z * scene.ambient_light.z;
+
+    if (HasDiffuse) {
+        color.x = (color.x + surface.replaced[0]);
+        color.y = (color.y + surface.replaced[1]);
+        color.z = (color.z + surface.replaced[2]);
+    }
+
+    int lights = scene.point_lights.size();
+    if ((HasDiffuse || HasSpecular) && scene.light_samples && lights > scene.light_samples) {
+        // pick light_samples lights in proportion to their bounds, each weighted by
+        // the inverse of its chance so the expected colour stays the same
+        lightBounds.resize(lights);
+        double total = 0;
+        for (int lightNo = 0; lightNo < lights; lightNo++) {
+            PointLight& currentLight = scene.point_lights[lightNo];
+            Vec3f toLight = (currentLight.position - hit.intersectPoint);
+            double dSquare = toLight.dot(toLight);
+            toLight = toLight.normalize();
+            total += LightBound<HasDiffuse, HasSpecular>(hit, surface, currentLight, toLight, dSquare);
+            lightBounds[lightNo] = total;
+        }
+        for (int sample = 0; total > 0 && sample < scene.light_samples; sample++) {
+            int lightNo = std::upper_bound(lightBounds.begin(), lightBounds.end(), NextRandom() * total) - lightBounds.begin();
+            lightNo = MIN(lightNo, lights - 1);
+            double bound = lightBounds[lightNo] - (lightNo ? lightBounds[lightNo - 1] : 0);
+            PointLight& currentLight = scene.point_lights[lightNo];
+            if (bound <= 0 || isShadow(hit, lightNo, currentLight, scene))
+                continue;
+            Vec3f toLight = (currentLight.position - hit.intersectPoint);
+            double dSquare = toLight.dot(toLight);
+            toLight = toLight.normalize();
+            Vec3f lit = { 0, 0, 0 };
+            Light<HasDiffuse, HasSpecular>(hit, surface, currentLight, toLight, dSquare, lit);
+            color = color + lit * (total / (bound * scene.light_samples));
+        }
+        lights = 0;
+    }
+
+    // Calculate shadow for all light, lights that cannot add up to
+    // scene.light_cutoff together are skipped
+    double cutoff = scene.light_cutoff / (lights * weight);
+    for (int lightNo = 0; (HasDiffuse || HasSpecular) && lightNo < lights; lightNo++) {
         PointLight& currentLight = scene.point_lights[lightNo];
+        Vec3f toLight = (currentLight.position - hit.intersectPoint);
+        double dSquare = toLight.dot(toLight);
+        toLight = toLight.normalize();
+        if (LightBound<HasDiffuse, HasSpecular>(hit, surface, currentLight, toLight, dSquare) < cutoff) {
+            lightsCulled++;
+            continue;
+        }
 
-        if (isShadow(hit, currentLight, scene)) {
+        if (isShadow(hit, lightNo, currentLight, scene)) {
 
             continue;
         }
 
         // Diffuse and Specular if not in shadow
+        Light<HasDiffuse, HasSpecular>(hit, surface, currentLight, toLight, dSquare, color);
+    }
 
-        double* specular = Specular(ray, hit, currentLight, scene);
-        color.x = (color.x + specular[0]);
-        color.y = (color.y + specular[1]);
-        color.z = (color.z + specular[2]);
-        delete[] specular;
+    // Reflected component
+    if (HasMirror) {
+        reflected.dir = hit.normal * 2 * hit.normal.dot(surface.toSource) - surface.toSource;
+        reflected.start = hit.intersectPoint + hit.normal * (scene.shadow_ray_epsilon);
+        ReflectDifferentials(ray, hit, scene, reflected);
+    }
+    return HasMirror;
+}
 
-        double* diffuse = Diffuse(ray, hit, &currentLight, scene);
-        color.x = (color.x + diffuse[0]);
-        color.y = (color.y + diffuse[1]);
-        color.z = (color.z + diffuse[2]);
-        delete[] diffuse;
+typedef bool (*ShadeKernel)(Ray& ray, Hit& hit, Surface& surface, double weight, Scene& scene, Vec3f& color, Ray& reflected);
+
+// Indexed by Material::features
+static const ShadeKernel shadeKernels[8] = {
+    Shade<false, false, false>,
+    Shade<true, false, false>,
+    Shade<false, true, false>,
+    Shade<true, true, false>,
+    Shade<false, false, true>,
+    Shade<true, false, true>,
+    Shade<false, true, true>,
+    Shade<true, true, true>,
+};
+
+// Colour of the environment map in direction dir, which need not be
+// normalized, filtered bilinearly inside the face dir points at
+void EnvironmentColor(EnvironmentMap& environment, Vec3f& dir, Vec3f& color)
+{
+    double v[3] = { dir.x, dir.y, dir.z };
+    int axis = fabs(v[0]) > fabs(v[1]) ? (fabs(v[0]) > fabs(v[2]) ? 0 : 2) : (fabs(v[1]) > fabs(v[2]) ? 1 : 2);
+    double major = fabs(v[axis]);
+    int size = environment.face_size;
+    uint32_t* face = &environment.texels[(size_t)(2 * axis + (v[axis] < 0)) * size * size];
+    double x = (v[(axis + 1) % 3] / major + 1) * 0.5 * size - 0.5;
+    double y = (v[(axis + 2) % 3] / major + 1) * 0.5 * size - 0.5;
+    int x0 = (int)floor(x), y0 = (int)floor(y);
+    double dx = x - x0, dy = y - y0;
+    int x1 = MIN(x0 + 1, size - 1), y1 = MIN(y0 + 1, size - 1);
+    x0 = MAX(x0, 0);
+    y0 = MAX(y0, 0);
+    uint32_t t00 = face[y0 * size + x0], t10 = face[y0 * size + x1];
+    uint32_t t01 = face[y1 * size + x0], t11 = face[y1 * size + x1];
+    double* channel[3] = { &color.x, &color.y, &color.z };
+    for (int c = 0; c < 3; c++) {
+        int shift = 8 * c;
+        *channel[c] = round((1 - dx) * (1 - dy) * ((t00 >> shift) & 0xff) + dx * (1 - dy) * ((t10 >> shift) & 0xff)
+            + (1 - dx) * dy * ((t01 >> shift) & 0xff) + dx * dy * ((t11 >> shift) & 0xff));
     }
+}
 
-    // Reflected component
-    unsigned char* mirrorness;
-    if (scene.materials[hit.materialID - 1].mirror.x || scene.materials[hit.materialID - 1].mirror.y || scene.materials[hit.materialID - 1].mirror.z) {
-        Ray newRay, toSource;
-        toSource.dir = (ray.start - hit.intersectPoint).normalize();
-        newRay.dir = hit.normal * 2 * hit.normal.dot(toSource.dir) - toSource.dir;
-        newRay.start = hit.intersectPoint + hit.normal * (scene.shadow_ray_epsilon);
-        mirrorness = CalculateColor(newRay, iterationCount - 1, scene);
+// First hit of a camera ray, compared between neighbouring samples
+struct Primary {
+    int object; // unique per mesh, triangle and sphere, -1 for the background
+    Vec3f normal;
+};
+
+// One hit along a mirror path
+struct Bounce {
+    Vec3f color; // shading at the hit without the reflection
+    Vec3f mirror;
+};
+
+static thread_local std::vector<Bounce> bounces;
+static thread_local long reflectionsCut = 0; // mirror rays not cast for their low throughput
+static thread_local long primaryRays = 0, reflectionRays = 0;
+
+// Follows ray through up to iterationCount mirror reflections. The path is
+// traced front to back, carrying the product of the mirror coefficients so
+// far, and stops once every channel of it is below scene.min_throughput.
+// The colours are then combined back to front, clipped at every level.
+// primary, if given, gets what the ray hits first.
+unsigned char* CalculateColor(Ray& ray, int iterationCount, Scene& scene, Primary* primary = NULL)
+{
+    unsigned char* ret = new unsigned char[3];
+    Vec3f tail = { 0, 0, 0 }; // colour beyond the last hit, in 8-bit levels
+    Vec3f throughput = { 1, 1, 1 };
+    Ray current = ray;
+    int count = 0;
+    if (primary)
+        primary->object = -1;
+    for (int depth = iterationCount; depth >= 0; depth--) {
+        Hit hit = ClosestHit(current, scene);
+        if (primary && count == 0 && hit.hitOccur) {
+            primary->object = hit.hitID * 4 + hit.hitType - MESHHIT;
+            primary->normal = hit.normal;
+        }
+        if (!hit.hitOccur) {
+            if (scene.environment.face_size) {
+                EnvironmentColor(scene.environment, current.dir, tail);
+                break;
+            }
+            tail.x = clip(scene.background_color.x);
+            tail.y = clip(scene.background_color.y);
+            tail.z = clip(scene.background_color.z);
+            break;
+        }
+        TransferDifferentials(current, hit);
 
-        color.x = (color.x + mirrorness[0] * scene.materials[hit.materialID - 1].mirror.x);
-        color.y = (color.y + mirrorness[1] * scene.materials[hit.materialID - 1].mirror.y);
-        color.z = (color.z + mirrorness[2] * scene.materials[hit.materialID - 1].mirror.z);
-        delete[] mirrorness;
+        Surface surface;
+        FetchSurface(current, hit, scene, surface);
+        // a texture can give the surface a diffuse term its material lacks
+        int features = surface.material->features;
+        if (surface.texture)
+            features |= MATERIAL_DIFFUSE;
+        if (count == bounces.size())
+            bounces.resize(count + 1);
+        Bounce& bounce = bounces[count++];
+        bounce.color.x = bounce.color.y = bounce.color.z = 0;
+        bounce.mirror = surface.material->mirror;
+        Ray reflected;
+        double weight = MAX(throughput.x, MAX(throughput.y, throughput.z));
+        if (!shadeKernels[features](current, hit, surface, weight, scene, bounce.color, reflected) || depth == 0)
+            break;
+
+        throughput.x *= bounce.mirror.x;
+        throughput.y *= bounce.mirror.y;
+        throughput.z *= bounce.mirror.z;
+        if (MAX(throughput.x, MAX(throughput.y, throughput.z)) < scene.min_throughput) {
+            reflectionsCut++;
+            break;
+        }
+        reflectionRays++;
+        current = reflected;
     }
 
     // Rounding and clipping
-    ret[0] = clip(color.x);
-    ret[1] = clip(color.y);
-    ret[2] = clip(color.z);
+    for (int k = count - 1; k >= 0; k--) {
+        Bounce& bounce = bounces[k];
+        tail.x = clip(bounce.color.x + tail.x * bounce.mirror.x);
+        tail.y = clip(bounce.color.y + tail.y * bounce.mirror.y);
+        tail.z = clip(bounce.color.z + tail.z * bounce.mirror.z);
+    }
+    ret[0] = tail.x;
+    ret[1] = tail.y;
+    ret[2] = tail.z;
     return ret;
 }
-void worker(Camera& camera, unsigned char*(&image), Scene& scene, int i, int j)
+
+static std::atomic<long> totalReflectionsCut(0);
+static std::atomic<long> totalLightsCulled(0);
+static std::atomic<long> totalOccluderTests(0), totalOccluderHits(0);
+static std::atomic<long> totalPixelsRefined(0);
+static std::atomic<long> totalRaysSaved(0), totalPixels(0);
+static std::atomic<long> totalPrimaryRays(0), totalShadowRays(0), totalReflectionRays(0);
+static std::atomic<long> totalBoxTests(0), totalTriangleTests(0), totalSphereTests(0);
+static std::atomic<long> totalLeaves(0), totalLeafDepth(0);
+
+// Traces sample number sample of pixel (t, k) through (dx, dy) inside the pixel
+void TracePixel(Camera& camera, Scene& scene, int t, int k, int sample, double dx, double dy, unsigned char* out, Primary* primary)
+{
+    Ray ray = Generate(camera, t, k, dx, dy);
+    primaryRays++;
+    lightRandom = (((uint32_t)t * camera.image_width + k) * 2654435761u + sample * 0x9e3779b9u) | 1;
+#ifdef RT_COUNTERS
+    TraversalCounters before = traversal;
+    long shadowsBefore = shadowRays;
+#endif
+    unsigned char* color = CalculateColor(ray, scene.max_recursion_depth, scene, primary);
+#ifdef RT_COUNTERS
+    if (heatmap && t >= heatmapRows[0] && t < heatmapRows[1]) {
+        size_t p = (size_t)t * camera.image_width + k;
+        heatmap->nodes[p] += traversal.boxTests - before.boxTests;
+        heatmap->primitives[p] += traversal.triangleTests + traversal.sphereTests - before.triangleTests - before.sphereTests;
+        heatmap->shadows[p] += shadowRays - shadowsBefore;
+    }
+#endif
+    out[0] = color[0];
+    out[1] = color[1];
+    out[2] = color[2];
+    delete[] color;
+}
+
+static double RadicalInverse(unsigned int bits)
+{
+    bits = (bits << 16) | (bits >> 16);
+    bits = ((bits & 0x55555555u) << 1) | ((bits & 0xAAAAAAAAu) >> 1);
+    bits = ((bits & 0x33333333u) << 2) | ((bits & 0xCCCCCCCCu) >> 2);
+    bits = ((bits & 0x0F0F0F0Fu) << 4) | ((bits & 0xF0F0F0F0u) >> 4);
+    bits = ((bits & 0x00FF00FFu) << 8) | ((bits & 0xFF00FF00u) >> 8);
+    return bits / 4294967296.0;
+}
+
+// Whether two first-pass samples see different objects or colours
+static bool Differs(unsigned char* a, Primary& primaryA, unsigned char* b, Primary& primaryB, int threshold)
+{
+    if (primaryA.object != primaryB.object)
+        return true;
+    for (int c = 0; c < 3; c++) {
+        if (abs(a[c] - b[c]) > threshold)
+            return true;
+    }
+    return false;
+}
+
+// Mean of the sample first and n more rays through pixel (t, k), placed on
+// a Hammersley pattern so they are stratified in x and y
+void Supersample(Camera& camera, Scene& scene, int t, int k, int n, unsigned char* first, unsigned char* out)
 {
+    double sum[3] = { (double)first[0], (double)first[1], (double)first[2] };
+    for (int sample = 1; sample <= n; sample++) {
+        unsigned char extra[3];
+        TracePixel(camera, scene, t, k, sample, (sample - 0.5) / n, RadicalInverse(sample - 1) + 0.5 / n, extra, NULL);
+        for (int c = 0; c < 3; c++)
+            sum[c] += extra[c];
+    }
+    for (int c = 0; c < 3; c++)
+        out[c] = clip(sum[c] / (n + 1));
+}
 
-    Ray currentRay;
+static thread_local std::vector<unsigned char> firstColors; // first pass of the block and its neighbour rows
+static thread_local std::vector<Primary> firstPrimaries;
+static thread_local long pixelsRefined = 0;
+
+// Traces one ray per pixel of the block and of the rows next to it, then
+// supersamples every pixel whose object or colour differs from one of its
+// four neighbours with scene.aa_samples more rays.
+void AntialiasBlock(Camera& camera, unsigned char* image, Scene& scene, int i, int j)
+{
+    int width = camera.image_width;
+    int top = MAX(i - 1, 0), bottom = MIN(j + 1, camera.image_height);
+    firstColors.resize((size_t)(bottom - top) * width * 3);
+    firstPrimaries.resize((size_t)(bottom - top) * width);
+    for (int t = top; t < bottom; t++) {
+        for (int k = 0; k < width; k++) {
+            size_t p = (size_t)(t - top) * width + k;
+            TracePixel(camera, scene, t, k, 0, 0.5, 0.5, &firstColors[3 * p], &firstPrimaries[p]);
+        }
+    }
+
+    auto differs = [&](size_t p, size_t q) {
+        return Differs(&firstColors[3 * p], firstPrimaries[p], &firstColors[3 * q], firstPrimaries[q], scene.aa_threshold);
+    };
     for (int t = i; t < j; t++) {
-        for (int k = 0; k < camera.image_width; k++) {
-            currentRay = Generate(camera, t, k);
-            unsigned char* color = CalculateColor(currentRay, scene.max_recursion_depth, scene);
-            image[3 * (t * (camera.image_width) + k)] = color[0];
-            image[3 * (t * (camera.image_width) + k) + 1] = color[1];
-            image[3 * (t * (camera.image_width) + k) + 2] = color[2];
-            delete[] color;
+        unsigned char* row = image + (size_t)(t - i) * width * 3;
+        for (int k = 0; k < width; k++) {
+            size_t p = (size_t)(t - top) * width + k;
+            unsigned char* first = &firstColors[3 * p];
+            bool edge = (k > 0 && differs(p, p - 1)) || (k + 1 < width && differs(p, p + 1))
+                || (t > top && differs(p, p - width)) || (t + 1 < bottom && differs(p, p + width));
+            if (!edge) {
+                memcpy(row + 3 * (size_t)k, first, 3);
+                continue;
+            }
+            pixelsRefined++;
+            Supersample(camera, scene, t, k, scene.aa_samples, first, row + 3 * (size_t)k);
+        }
+    }
+}
+
+static thread_local std::vector<Primary> cornerPrimaries; // per pixel of the block, valid where traced
+static thread_local std::vector<char> traced;
+static thread_local long raysSaved = 0;
+
+// Traces every scene.subsample-th pixel of every scene.subsample-th row of
+// the block, plus its last row and column. Cells whose four corners see the
+// same object with about the same normal and colour are filled by bilinear
+// interpolation, the other cells are traced in full.
+void SubsampleBlock(Camera& camera, unsigned char* image, Scene& scene, int i, int j)
+{
+    int width = camera.image_width, step = scene.subsample;
+    size_t pixels = (size_t)(j - i) * width;
+    cornerPrimaries.resize(pixels);
+    traced.assign(pixels, 0);
+    auto trace = [&](int t, int k) {
+        size_t p = (size_t)(t - i) * width + k;
+        if (!traced[p]) {
+            TracePixel(camera, scene, t, k, 0, 0.5, 0.5, image + 3 * p, &cornerPrimaries[p]);
+            traced[p] = 1;
+        }
+    };
+    std::vector<int> rows, cols;
+    for (int t = i; t < j; t += step)
+        rows.push_back(t);
+    if (rows.back() != j - 1)
+        rows.push_back(j - 1);
+    for (int k = 0; k < width; k += step)
+        cols.push_back(k);
+    if (cols.back() != width - 1)
+        cols.push_back(width - 1);
+    if (rows.size() < 2 || cols.size() < 2) {
+        for (int t = i; t < j; t++) {
+            for (int k = 0; k < width; k++)
+                trace(t, k);
+        }
+        return;
+    }
+    for (int r = 0; r < rows.size(); r++) {
+        for (int c = 0; c < cols.size(); c++)
+            trace(rows[r], cols[c]);
+    }
+
+    auto similar = [&](int t0, int k0, int t1, int k1) {
+        size_t p = (size_t)(t0 - i) * width + k0, q = (size_t)(t1 - i) * width + k1;
+        if (Differs(image + 3 * p, cornerPrimaries[p], image + 3 * q, cornerPrimaries[q], scene.aa_threshold))
+            return false;
+        return cornerPrimaries[p].object == -1 || cornerPrimaries[p].normal.dot(cornerPrimaries[q].normal) > 0.95;
+    };
+    std::vector<char> uniform((rows.size() - 1) * (cols.size() - 1));
+    for (int r = 0; r + 1 < rows.size(); r++) {
+        for (int c = 0; c + 1 < cols.size(); c++) {
+            int t0 = rows[r], t1 = rows[r + 1], k0 = cols[c], k1 = cols[c + 1];
+            bool same = similar(t0, k0, t0, k1) && similar(t0, k0, t1, k0) && similar(t0, k0, t1, k1);
+            uniform[r * (cols.size() - 1) + c] = same;
+            if (same)
+                continue;
+            for (int t = t0; t <= t1; t++) {
+                for (int k = k0; k <= k1; k++)
+                    trace(t, k);
+            }
+        }
+    }
+    // pixels on the border of a traced cell keep their traced colour
+    for (int r = 0; r + 1 < rows.size(); r++) {
+        for (int c = 0; c + 1 < cols.size(); c++) {
+            if (!uniform[r * (cols.size() - 1) + c])
+                continue;
+            int t0 = rows[r], t1 = rows[r + 1], k0 = cols[c], k1 = cols[c + 1];
+            unsigned char* c00 = image + 3 * ((size_t)(t0 - i) * width + k0);
+            unsigned char* c01 = image + 3 * ((size_t)(t0 - i) * width + k1);
+            unsigned char* c10 = image + 3 * ((size_t)(t1 - i) * width + k0);
+            unsigned char* c11 = image + 3 * ((size_t)(t1 - i) * width + k1);
+            for (int t = t0; t <= t1; t++) {
+                double dy = (double)(t - t0) / (t1 - t0);
+                for (int k = k0; k <= k1; k++) {
+                    size_t p = (size_t)(t - i) * width + k;
+                    if (traced[p])
+                        continue;
+                    double dx = (double)(k - k0) / (k1 - k0);
+                    for (int ch = 0; ch < 3; ch++)
+                        image[3 * p + ch] = clip((1 - dx) * (1 - dy) * c00[ch] + dx * (1 - dy) * c01[ch] + (1 - dx) * dy * c10[ch] + dx * dy * c11[ch]);
+                }
+            }
+        }
+    }
+    for (size_t p = 0; p < pixels; p++)
+        raysSaved += !traced[p];
+}
+
+// Adds the counters of the calling thread to the totals
+void FlushCounters()
+{
+    totalReflectionsCut += reflectionsCut;
+    reflectionsCut = 0;
+    totalLightsCulled += lightsCulled;
+    lightsCulled = 0;
+    totalOccluderTests += occluderTests;
+    totalOccluderHits += occluderHits;
+    occluderTests = occluderHits = 0;
+    totalPixelsRefined += pixelsRefined;
+    pixelsRefined = 0;
+    totalRaysSaved += raysSaved;
+    raysSaved = 0;
+    totalPrimaryRays += primaryRays;
+    totalShadowRays += shadowRays;
+    totalReflectionRays += reflectionRays;
+    primaryRays = shadowRays = reflectionRays = 0;
+#ifdef RT_COUNTERS
+    totalBoxTests += traversal.boxTests;
+    totalTriangleTests += traversal.triangleTests;
+    totalSphereTests += traversal.sphereTests;
+    totalLeaves += traversal.leaves;
+    totalLeafDepth += traversal.leafDepth;
+    memset(&traversal, 0, sizeof(traversal));
+#endif
+}
+
+void ResetOccluders(Scene& scene)
+{
+    Occluder none = { 0, 0, 0 };
+    occluders.assign(scene.point_lights.size(), none);
+}
+
+void worker(Camera& camera, unsigned char* image, Scene& scene, int i, int j)
+{
+    // image points to the first row of the block [i, j)
+    ResetOccluders(scene);
+#ifdef RT_COUNTERS
+    heatmapRows[0] = i;
+    heatmapRows[1] = j;
+#endif
+    if (scene.subsample > 1) {
+        SubsampleBlock(camera, image, scene, i, j);
+    } else if (scene.aa_samples) {
+        AntialiasBlock(camera, image, scene, i, j);
+    } else {
+        for (int t = i; t < j; t++) {
+            unsigned char* row = image + (size_t)(t - i) * camera.image_width * 3;
+            for (int k = 0; k < camera.image_width; k++)
+                TracePixel(camera, scene, t, k, 0, 0.5, 0.5, row + 3 * (size_t)k, NULL);
+        }
+    }
+    FlushCounters();
+}
+
+struct RenderOptions {
+    bool stream; // flush finished row blocks to the output file instead of keeping the whole image
+    bool compile; // write each scene as a compiled .rtscene file instead of rendering it
+    std::string bvhCache; // directory for cached mesh BVHs
+    std::string textureCache; // directory for paged textures, empty to keep them in memory
+    int textureCacheMB;
+    bool mipmaps;
+    double minThroughput;
+    double lightCutoff;
+    int lightSamples;
+    int aaSamples;
+    int aaThreshold;
+    int subsample;
+    bool progressive; // render coarse to fine until done, out of time or interrupted
+    int timeBudget; // milliseconds per image in progressive mode, 0 for none
+    int benchRuns; // timed renders per scene, 0 renders the images normally
+    bool stats; // print the time of every phase after each scene
+    bool heatmap;
+    RenderOptions()
+    {
+        heatmap = false;
+        stats = false;
+        benchRuns = 0;
+        progressive = false;
+        timeBudget = 0;
+        subsample = 1;
+        aaSamples = 0;
+        aaThreshold = 16;
+        lightCutoff = 0.5;
+        lightSamples = 0;
+        mipmaps = true;
+        minThroughput = 0.5 / 255;
+        textureCacheMB = 256;
+        stream = false;
+        compile = false;
+    }
+};
+
+static bool hasExtension(const std::string& name, const char* extension)
+{
+    size_t length = strlen(extension);
+    if (name.size() < length)
+        return false;
+    std::string tail = name.substr(name.size() - length);
+    std::transform(tail.begin(), tail.end(), tail.begin(), ::tolower);
+    return tail == extension;
+}
+
+// Renders the whole image of camera, the caller deletes it
+unsigned char* traceImage(Camera& camera, Scene& scene)
+{
+    size_t rowSize = (size_t)camera.image_width * 3;
+    unsigned char* image = new unsigned char[rowSize * camera.image_height];
+    int blocks = (camera.image_height + BLOCK_ROWS - 1) / BLOCK_ROWS;
+    parallel_for(blocks, [&](int block) {
+        int i = block * BLOCK_ROWS;
+        int j = MIN(i + BLOCK_ROWS, camera.image_height);
+        worker(camera, image + i * rowSize, scene, i, j);
+    });
+    return image;
+}
+
+#ifdef RT_COUNTERS
+// Writes values as a false-colour image named after the image of camera
+// with suffix, going from black for none over blue, cyan, green and yellow
+// to red at the 99th percentile, so a few outliers do not wash it out.
+// The file is a jpeg if the image is one and a ppm otherwise.
+static void writeHeatmap(Camera& camera, std::vector<uint32_t>& values, const char* suffix)
+{
+    static const unsigned char ramp[6][3] = { { 0, 0, 0 }, { 0, 0, 255 }, { 0, 255, 255 }, { 0, 255, 0 }, { 255, 255, 0 }, { 255, 0, 0 } };
+    std::vector<uint32_t> sorted(values);
+    size_t rank = sorted.size() * 99 / 100;
+    std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+    double top = MAX(sorted[rank], 1);
+
+    unsigned char* image = new unsigned char[values.size() * 3];
+    for (size_t p = 0; p < values.size(); p++) {
+        double x = MIN(values[p] / top, 1.0) * 5;
+        int segment = MIN((int)x, 4);
+        double f = x - segment;
+        for (int ch = 0; ch < 3; ch++)
+            image[3 * p + ch] = round((1 - f) * ramp[segment][ch] + f * ramp[segment + 1][ch]);
+    }
+
+    std::string name = camera.image_name;
+    size_t dot = name.rfind('.');
+    std::string extension = dot == std::string::npos ? ".ppm" : name.substr(dot);
+    name = name.substr(0, dot) + suffix + extension;
+    if (hasExtension(name, ".jpg") || hasExtension(name, ".jpeg"))
+        write_jpeg(name.c_str(), image, camera.image_width, camera.image_height);
+    else
+        write_ppm(name.c_str(), image, camera.image_width, camera.image_height);
+    delete[] image;
+    std::cout << name << ": red at " << top << " per pixel" << std::endl;
+}
+#endif
+
+void renderImage(Camera& camera, Scene& scene)
+{
+#ifdef RT_COUNTERS
+    Heatmap costs;
+    if (scene.heatmap) {
+        size_t pixels = (size_t)camera.image_width * camera.image_height;
+        costs.nodes.assign(pixels, 0);
+        costs.primitives.assign(pixels, 0);
+        costs.shadows.assign(pixels, 0);
+        heatmap = &costs;
+    }
+#endif
+    unsigned char* image;
+    {
+        ScopedTimer timer("trace");
+        image = traceImage(camera, scene);
+    }
+    ScopedTimer timer("write");
+    write_ppm(camera.image_name.c_str(), image, camera.image_width, camera.image_height);
+    delete[] image;
+#ifdef RT_COUNTERS
+    if (heatmap) {
+        writeHeatmap(camera, costs.nodes, "_nodes");
+        writeHeatmap(camera, costs.primitives, "_primitives");
+        writeHeatmap(camera, costs.shadows, "_shadows");
+        heatmap = NULL;
+    }
+#endif
+}
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void onInterrupt(int)
+{
+    interrupted = 1;
+}
+
+// Renders coarse to fine: one ray per 8x8 pixels, then per 4x4, 2x2 and
+// every pixel, then extra samples on edges. Each traced pixel paints the
+// block it stands for, so the image is whole after every pass. When the
+// deadline passes or SIGINT arrives, the pass stops where it is, keeping the
+// previous pass elsewhere, and the image is written as usual.
+void renderProgressive(Camera& camera, Scene& scene, std::chrono::steady_clock::time_point deadline)
+{
+    int width = camera.image_width, height = camera.image_height;
+    size_t rowSize = (size_t)width * 3;
+    unsigned char* image = new unsigned char[rowSize * height];
+    memset(image, 0, rowSize * height);
+    std::vector<Primary> primaries((size_t)width * height);
+    std::atomic<bool> stop(false);
+    auto expired = [&]() {
+        if (interrupted || std::chrono::steady_clock::now() >= deadline)
+            stop = true;
+        return stop.load();
+    };
+
+    int finest = 0; // step of the last whole pass
+    for (int step = 8; step >= 1 && !expired(); step /= 2) {
+        int rows = (height + step - 1) / step;
+        parallel_for(rows, [&](int r) {
+            if (expired())
+                return;
+            ResetOccluders(scene);
+            int t = r * step;
+            for (int k = 0; k < width; k += step) {
+                if (step < 8 && t % (2 * step) == 0 && k % (2 * step) == 0)
+                    continue; // traced by the previous pass, its block already shows it
+                unsigned char color[3];
+                TracePixel(camera, scene, t, k, 0, 0.5, 0.5, color, &primaries[(size_t)t * width + k]);
+                for (int y = t; y < MIN(t + step, height); y++) {
+                    for (int x = k; x < MIN(k + step, width); x++)
+                        memcpy(image + y * rowSize + 3 * (size_t)x, color, 3);
+                }
+            }
+            FlushCounters();
+        });
+        if (!stop)
+            finest = step;
+    }
+
+    bool refined = false;
+    if (finest == 1 && !expired()) {
+        std::vector<unsigned char> first(image, image + rowSize * height);
+        int samples = scene.aa_samples ? scene.aa_samples : 4;
+        parallel_for(height, [&](int t) {
+            if (expired())
+                return;
+            ResetOccluders(scene);
+            for (int k = 0; k < width; k++) {
+                size_t p = (size_t)t * width + k;
+                bool edge = false;
+                if (k > 0)
+                    edge = edge || Differs(&first[3 * p], primaries[p], &first[3 * (p - 1)], primaries[p - 1], scene.aa_threshold);
+                if (k + 1 < width)
+                    edge = edge || Differs(&first[3 * p], primaries[p], &first[3 * (p + 1)], primaries[p + 1], scene.aa_threshold);
+                if (t > 0)
+                    edge = edge || Differs(&first[3 * p], primaries[p], &first[3 * (p - width)], primaries[p - width], scene.aa_threshold);
+                if (t + 1 < height)
+                    edge = edge || Differs(&first[3 * p], primaries[p], &first[3 * (p + width)], primaries[p + width], scene.aa_threshold);
+                if (edge) {
+                    pixelsRefined++;
+                    Supersample(camera, scene, t, k, samples, &first[3 * p], image + 3 * p);
+                }
+            }
+            FlushCounters();
+        });
+        refined = !stop;
+    }
+
+    {
+        ScopedTimer timer("write");
+        write_ppm(camera.image_name.c_str(), image, width, height);
+    }
+    delete[] image;
+    if (!refined) {
+        if (finest)
+            std::cout << camera.image_name << ": stopped with one ray per " << finest << "x" << finest << " pixels" << std::endl;
+        else
+            std::cout << camera.image_name << ": stopped before the coarsest pass" << std::endl;
+    }
+}
+
+// Renders row blocks on the worker threads while the calling thread writes
+// them out in order. Only a fixed window of blocks is ever allocated, so the
+// memory does not depend on the image height.
+void renderStreaming(Camera& camera, Scene& scene)
+{
+    size_t rowSize = (size_t)camera.image_width * 3;
+    int blocks = (camera.image_height + BLOCK_ROWS - 1) / BLOCK_ROWS;
+    int threadCount = worker_count();
+    int window = 2 * threadCount;
+
+    bool jpeg = hasExtension(camera.image_name, ".jpg") || hasExtension(camera.image_name, ".jpeg");
+    jpeg_stream* jpegOut = NULL;
+    FILE* ppmOut = NULL;
+    if (jpeg)
+        jpegOut = jpeg_stream_open(camera.image_name.c_str(), camera.image_width, camera.image_height);
+    else
+        ppmOut = ppm_stream_open(camera.image_name.c_str(), camera.image_width, camera.image_height);
+
+    std::vector<unsigned char*> slots(window);
+    std::vector<bool> ready(window, false);
+    for (int s = 0; s < window; s++)
+        slots[s] = new unsigned char[rowSize * BLOCK_ROWS];
+
+    std::mutex lock;
+    std::condition_variable changed;
+    int next = 0, written = 0;
+    bool stopped = false; // set when writing fails, the workers return
+
+    auto render = [&]() {
+        while (true) {
+            int block;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                changed.wait(guard, [&]() { return stopped || next >= blocks || next < written + window; });
+                if (stopped || next >= blocks)
+                    return;
+                block = next++;
+            }
+            int i = block * BLOCK_ROWS;
+            int j = MIN(i + BLOCK_ROWS, camera.image_height);
+            worker(camera, slots[block % window], scene, i, j);
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                ready[block % window] = true;
+            }
+            changed.notify_all();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threadCount; t++)
+        threads.push_back(std::thread(render));
+
+    try {
+        for (int block = 0; block < blocks; block++) {
+            int slot = block % window;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                changed.wait(guard, [&]() { return (bool)ready[slot]; });
+            }
+            int count = MIN(BLOCK_ROWS, camera.image_height - block * BLOCK_ROWS);
+            ScopedTimer timer("write");
+            if (jpeg)
+                jpeg_stream_write(jpegOut, slots[slot], count);
+            else
+                ppm_stream_write(ppmOut, slots[slot], camera.image_width, count);
+            timer.stop();
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                ready[slot] = false;
+                written++;
+            }
+            changed.notify_all();
         }
+    } catch (...) {
+        // join the workers before the error leaves, the threads would terminate the program
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopped = true;
+        }
+        changed.notify_all();
+        for (auto& thread : threads)
+            thread.join();
+        for (int s = 0; s < window; s++)
+            delete[] slots[s];
+        if (jpeg)
+            jpeg_stream_abort(jpegOut);
+        else
+            ppm_stream_abort(ppmOut);
+        throw;
     }
+
+    for (auto& thread : threads)
+        thread.join();
+    for (int s = 0; s < window; s++)
+        delete[] slots[s];
+    if (jpeg)
+        jpeg_stream_close(jpegOut);
+    else
+        ppm_stream_close(ppmOut);
+}
+
+static std::string jsonString(const std::string& text)
+{
+    std::string out = "\"";
+    for (int i = 0; i < text.size(); i++) {
+        char c = text[i];
+        if (c == '"' || c == '\\')
+            out += '\\';
+        if ((unsigned char)c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        } else
+            out += c;
+    }
+    return out + "\"";
+}
+
+// Renders every camera of scene once to warm up and then runs more times,
+// without writing the images, and prints the timings as a JSON object.
+// Rays are counted over the timed runs. main runs every scene in its own
+// process, so the peak RSS is the scene's.
+void benchScene(const std::string& input, Scene& scene, int runs)
+{
+    std::vector<double> seconds;
+    for (int run = 0; run <= runs; run++) {
+        if (run == 1)
+            totalPrimaryRays = totalShadowRays = totalReflectionRays = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int cam = 0; cam < scene.cameras.size(); cam++)
+            delete[] traceImage(scene.cameras[cam], scene);
+        auto stop = std::chrono::steady_clock::now();
+        if (run > 0)
+            seconds.push_back(std::chrono::duration<double>(stop - start).count());
+    }
+    std::sort(seconds.begin(), seconds.end());
+    double median = runs % 2 ? seconds[runs / 2] : (seconds[runs / 2 - 1] + seconds[runs / 2]) / 2;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    long rays[3] = { totalPrimaryRays / runs, totalShadowRays / runs, totalReflectionRays / runs };
+    std::cout << "    {\"scene\": " << jsonString(input)
+              << ", \"median_ms\": " << median * 1000
+              << ", \"min_ms\": " << seconds.front() * 1000
+              << ", \"max_ms\": " << seconds.back() * 1000
+              << ", \"primary_rays\": " << rays[0]
+              << ", \"shadow_rays\": " << rays[1]
+              << ", \"reflection_rays\": " << rays[2]
+              << ", \"primary_rays_per_s\": " << (long)(rays[0] / median)
+              << ", \"shadow_rays_per_s\": " << (long)(rays[1] / median)
+              << ", \"reflection_rays_per_s\": " << (long)(rays[2] / median)
+              << ", \"peak_rss_kb\": " << usage.ru_maxrss << "}";
+}
+
+static void usage(const char* program)
+{
+    std::cerr << "Usage: " << program << " [options] scene.xml..." << std::endl;
+    std::cerr << "  --threads N   number of render threads" << std::endl;
+    std::cerr << "  --heatmap     also write _nodes, _primitives and _shadows images of the cost of every pixel (make counters)" << std::endl;
+    std::cerr << "  --stats       print how long loading, BVH building, texture decoding, tracing and writing took" << std::endl;
+    std::cerr << "  --bench N     render each scene once to warm up and N more times without writing images, print JSON timings" << std::endl;
+    std::cerr << "  --stream      write row blocks as they finish (binary ppm, or jpeg for .jpg names)" << std::endl;
+    std::cerr << "  --compile     save each scene.xml as scene.rtscene, which loads without parsing" << std::endl;
+    std::cerr << "  --bvh-cache DIR  reuse mesh BVHs built by earlier runs from DIR" << std::endl;
+    std::cerr << "  --no-mipmaps  always sample the full resolution textures" << std::endl;
+    std::cerr << "  --min-throughput X  stop mirror paths weighted below X (default half an 8-bit level, 0 follows all)" << std::endl;
+    std::cerr << "  --light-cutoff X  skip the lights of a hit that add less than X 8-bit levels together (default 0.5, 0 shades every light as before)" << std::endl;
+    std::cerr << "  --light-samples N  shade N lights per hit picked by their contribution when there are more" << std::endl;
+    std::cerr << "  --aa N        add N samples to pixels that differ from a neighbour (0, the default, turns it off)" << std::endl;
+    std::cerr << "  --aa-threshold X  8-bit levels by which neighbours may differ before --aa or --subsample trace more (default 16)" << std::endl;
+    std::cerr << "  --subsample N  trace every Nth pixel and interpolate the cells between them that look alike" << std::endl;
+    std::cerr << "  --progressive  render coarse to fine, Ctrl-C writes the image as far as it got" << std::endl;
+    std::cerr << "  --time-budget MS  progressive, writing each image after at most MS milliseconds" << std::endl;
+    std::cerr << "  --texture-cache DIR  page textures in on demand from files converted into DIR" << std::endl;
+    std::cerr << "  --texture-cache-mb N  memory for paged texture tiles (default 256)" << std::endl;
 }
 
 int main(int argc, char* argv[])
 {
-    // Sample usage for reading an XML scene file
+    RenderOptions options;
+    std::vector<const char*> inputs;
+    for (int arg = 1; arg < argc; arg++) {
+        std::string flag = argv[arg];
+        if (flag == "--stream") {
+            options.stream = true;
+        } else if (flag == "--compile") {
+            options.compile = true;
+        } else if (flag == "--no-mipmaps") {
+            options.mipmaps = false;
+        } else if (flag == "--min-throughput" && arg + 1 < argc) {
+            options.minThroughput = atof(argv[++arg]);
+        } else if (flag == "--light-cutoff" && arg + 1 < argc) {
+            options.lightCutoff = atof(argv[++arg]);
+        } else if (flag == "--light-samples" && arg + 1 < argc) {
+            options.lightSamples = atoi(argv[++arg]);
+        } else if (flag == "--aa" && arg + 1 < argc) {
+            options.aaSamples = atoi(argv[++arg]);
+        } else if (flag == "--aa-threshold" && arg + 1 < argc) {
+            options.aaThreshold = atoi(argv[++arg]);
+        } else if (flag == "--subsample" && arg + 1 < argc) {
+            options.subsample = atoi(argv[++arg]);
+        } else if (flag == "--progressive") {
+            options.progressive = true;
+        } else if (flag == "--time-budget" && arg + 1 < argc) {
+            options.progressive = true;
+            options.timeBudget = atoi(argv[++arg]);
+        } else if (flag == "--texture-cache" && arg + 1 < argc) {
+            options.textureCache = argv[++arg];
+        } else if (flag == "--texture-cache-mb" && arg + 1 < argc) {
+            options.textureCacheMB = atoi(argv[++arg]);
+        } else if (flag == "--bvh-cache" && arg + 1 < argc) {
+            options.bvhCache = argv[++arg];
+        } else if (flag == "--heatmap") {
+            options.heatmap = true;
+        } else if (flag == "--stats") {
+            options.stats = true;
+        } else if (flag == "--bench" && arg + 1 < argc) {
+            options.benchRuns = atoi(argv[++arg]);
+            options.benchRuns = MAX(1, options.benchRuns);
+        } else if (flag == "--threads" && arg + 1 < argc) {
+            set_worker_count(atoi(argv[++arg]));
+        } else if (flag.compare(0, 2, "--") == 0) {
+            usage(argv[0]);
+            return 1;
+        } else {
+            inputs.push_back(argv[arg]);
+        }
+    }
+
+#ifndef RT_COUNTERS
+    if (options.heatmap) {
+        std::cerr << "--heatmap needs a build with counters, see make counters" << std::endl;
+        return 1;
+    }
+#endif
+    if (options.subsample > 1 && options.aaSamples) {
+        std::cerr << "--subsample cannot be combined with --aa" << std::endl;
+        return 1;
+    }
+    if (options.progressive && (options.stream || options.subsample > 1 || options.benchRuns)) {
+        std::cerr << "--progressive and --time-budget cannot be combined with --stream, --subsample or --bench" << std::endl;
+        return 1;
+    }
+    if (options.heatmap && (options.stream || options.progressive || options.benchRuns)) {
+        std::cerr << "--heatmap cannot be combined with --stream, --progressive or --bench" << std::endl;
+        return 1;
+    }
+
+    if (options.progressive)
+        signal(SIGINT, onInterrupt);
+    timers_enable(options.stats);
 
-    for (int inID = 1; inID < argc; inID++) {
+    if (!options.textureCache.empty())
+        texture_stream_configure(options.textureCache, (size_t)options.textureCacheMB << 20);
+
+    // images of the previous scene stay alive until the next scene is loaded,
+    // so a batch sharing texture files decodes each of them once
+    std::vector<std::shared_ptr<TextureImage>> lastImages;
+    bool firstBench = true;
+    bool failed = false; // a scene or image was skipped, the exit code says so
+    if (options.benchRuns)
+        std::cout << "{\"threads\": " << worker_count() << ", \"runs\": " << options.benchRuns << ", \"scenes\": [" << std::endl;
+    for (int inID = 0; inID < inputs.size(); inID++) {
+
+        // every scene is benchmarked in a child process, so that the peak RSS
+        // it reports is not a larger scene's before it
+        pid_t child = -1;
+        if (options.benchRuns) {
+            std::cout.flush();
+            child = fork();
+            if (child > 0) {
+                int status;
+                waitpid(child, &status, 0);
+                if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+                    firstBench = false;
+                else
+                    failed = true;
+                continue;
+            }
+        }
 
         Scene scene;
-        scene.loadFromXml(argv[inID]);
+        scene.bvh_cache_dir = options.bvhCache;
+        std::string input = inputs[inID];
+        timers_reset();
+        try {
+            ScopedTimer timer("load");
+            if (hasExtension(input, ".rtscene"))
+                scene.loadCompiled(input);
+            else
+                scene.loadFromXml(input);
+        } catch (std::exception& error) {
+            std::cerr << input << ": " << error.what() << std::endl;
+            if (child == 0)
+                _exit(1);
+            failed = true;
+            continue;
+        }
+        scene.mipmaps = options.mipmaps;
+        scene.min_throughput = options.minThroughput;
+        scene.light_cutoff = options.lightCutoff;
+        scene.light_samples = options.lightSamples;
+        scene.aa_samples = options.aaSamples;
+        scene.aa_threshold = options.aaThreshold;
+        scene.subsample = options.subsample;
+        scene.heatmap = options.heatmap;
+        lastImages.clear();
+        for (int i = 0; i < scene.textures.size(); i++)
+            lastImages.push_back(scene.textures[i].data);
+
+        if (options.compile) {
+            std::string output = input;
+            if (hasExtension(output, ".xml"))
+                output = output.substr(0, output.size() - 4);
+            output += ".rtscene";
+            scene.saveCompiled(output);
+            std::cout << output << std::endl;
+            continue;
+        }
 
-        // test values
+        if (options.benchRuns) {
+            if (!firstBench)
+                std::cout << "," << std::endl;
+            firstBench = false;
+            benchScene(input, scene, options.benchRuns);
+            if (child == 0) {
+                std::cout.flush();
+                _exit(0);
+            }
+            continue;
+        }
 
         auto start = std::chrono::high_resolution_clock::now();
+        totalReflectionsCut = 0;
+        totalLightsCulled = 0;
+        totalOccluderTests = totalOccluderHits = 0;
+        totalPixelsRefined = 0;
+        totalRaysSaved = totalPixels = 0;
+        totalPrimaryRays = totalShadowRays = totalReflectionRays = 0;
+        totalBoxTests = totalTriangleTests = totalSphereTests = 0;
+        totalLeaves = totalLeafDepth = 0;
 
+        ScopedTimer renderTimer("render");
         for (int cam = 0; cam < scene.cameras.size(); cam++) {
             Camera& camera = scene.cameras[cam];
-            unsigned char* image = new unsigned char[camera.image_width * camera.image_height * 3];
-            int index = 0;
-            //worker(camera, image, scene, 0, camera.image_height);
-
-            int i = camera.image_height / 10;
-            std::thread t1(&worker, std::ref(camera), std::ref(image), std::ref(scene), 0, i);
-            std::thread t2(&worker, std::ref(camera), std::ref(image), std::ref(scene), i, 2 * i);
-            std::thread t3(&worker, std::ref(camera), std::ref(image), std::ref(scene), 2 * i, 3 * i);
-            std::thread t4(&worker, std::ref(camera), std::ref(image), std::ref(scene), 3 * i, 4 * i);
-            std::thread t5(&worker, std::ref(camera), std::ref(image), std::ref(scene), 4 * i, 5 * i);
-            std::thread t6(&worker, std::ref(camera), std::ref(image), std::ref(scene), 5 * i, 6 * i);
-            std::thread t7(&worker, std::ref(camera), std::ref(image), std::ref(scene), 6 * i, 7 * i);
-            std::thread t8(&worker, std::ref(camera), std::ref(image), std::ref(scene), 7 * i, 8 * i);
-            std::thread t9(&worker, std::ref(camera), std::ref(image), std::ref(scene), 8 * i, 9 * i);
-            std::thread t10(&worker, std::ref(camera), std::ref(image), std::ref(scene), 9 * i, 10 * i);
-            if (camera.image_height % 10 != 0) {
-                std::thread t11(&worker, std::ref(camera), std::ref(image), std::ref(scene), 10 * i, camera.image_height);
-                t11.join();
+            totalPixels += (long)camera.image_width * camera.image_height;
+            try {
+                if (options.progressive) {
+                    auto deadline = std::chrono::steady_clock::time_point::max();
+                    if (options.timeBudget > 0)
+                        deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(options.timeBudget);
+                    renderProgressive(camera, scene, deadline);
+                } else if (options.stream)
+                    renderStreaming(camera, scene);
+                else
+                    renderImage(camera, scene);
+            } catch (std::exception& error) {
+                std::cerr << camera.image_name << ": " << error.what() << std::endl;
+                failed = true;
             }
-            t1.join();
-            t2.join();
-            t3.join();
-            t4.join();
-            t5.join();
-            t6.join();
-            t7.join();
-            t8.join();
-            t9.join();
-            t10.join();
-
-            write_ppm(camera.image_name.c_str(), image, camera.image_width, camera.image_height);
-            delete[] image;
+            if (interrupted)
+                break; // the image is written, skip the remaining ones
         }
+        renderTimer.stop();
         auto stop = std::chrono::high_resolution_clock::now();
         auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - start);
-        std::cout << argv[inID] << std::endl;
+        std::cout << inputs[inID] << std::endl;
         std::cout << duration.count() << std::endl;
+        if (totalReflectionsCut)
+            std::cout << totalReflectionsCut << " reflections cut" << std::endl;
+        if (totalLightsCulled)
+            std::cout << totalLightsCulled << " lights culled" << std::endl;
+        if (totalOccluderTests)
+            std::cout << totalOccluderHits << " of " << totalOccluderTests << " cached occluders blocked the light" << std::endl;
+        if (totalPixelsRefined)
+            std::cout << totalPixelsRefined << " pixels antialiased" << std::endl;
+        if (totalRaysSaved)
+            std::cout << "subsampling saved " << 100.0 * totalRaysSaved / totalPixels << "% of the camera rays" << std::endl;
+#ifdef RT_COUNTERS
+        std::cout << totalPrimaryRays << " primary, " << totalShadowRays << " shadow and " << totalReflectionRays << " reflection rays" << std::endl;
+        std::cout << totalBoxTests << " box, " << totalTriangleTests << " triangle and " << totalSphereTests << " sphere tests" << std::endl;
+        if (totalLeaves)
+            std::cout << "BVH leaves reached at an average depth of " << (double)totalLeafDepth / totalLeaves << std::endl;
+#endif
+        if (options.stats)
+            timers_print(std::cout);
+        if (interrupted)
+            break;
     }
-    return 0;
+    if (options.benchRuns)
+        std::cout << std::endl
+                  << "]}" << std::endl;
+    return failed ? 1 : 0;
 }
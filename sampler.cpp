@@ -0,0 +1,197 @@
+#include "sampler.h"
+#include <math.h>
+#include <stdexcept>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace parser;
+
+#ifdef __SSE2__
+// Weights the RGB channels of four packed texels, ordered t00 t10 t01 t11
+static void BlendTexels(__m128i texels, double dx, double dy, double* ret)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i top16 = _mm_unpacklo_epi8(texels, zero);
+    __m128i bottom16 = _mm_unpackhi_epi8(texels, zero);
+    __m128 c00 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(top16, zero));
+    __m128 c10 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(top16, zero));
+    __m128 c01 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(bottom16, zero));
+    __m128 c11 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(bottom16, zero));
+    __m128 color = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c00, _mm_set1_ps((1 - dx) * (1 - dy))), _mm_mul_ps(c10, _mm_set1_ps(dx * (1 - dy)))),
+        _mm_add_ps(_mm_mul_ps(c01, _mm_set1_ps((1 - dx) * dy)), _mm_mul_ps(c11, _mm_set1_ps(dx * dy))));
+    float rgba[4];
+    _mm_storeu_ps(rgba, color);
+    ret[0] = rgba[0];
+    ret[1] = rgba[1];
+    ret[2] = rgba[2];
+}
+#endif
+
+// Weights the RGB channels of four packed texels
+static void BlendTexels(uint32_t t00, uint32_t t10, uint32_t t01, uint32_t t11, double dx, double dy, double* ret)
+{
+#ifdef __SSE2__
+    __m128i texels = _mm_set_epi32(t11, t01, t10, t00);
+    BlendTexels(texels, dx, dy, ret);
+#else
+    for (int c = 0; c < 3; c++) {
+        int shift = 8 * c;
+        ret[c] = dx * dy * ((t11 >> shift) & 0xff)
+            + (1 - dx) * dy * ((t01 >> shift) & 0xff)
+            + dx * (1 - dy) * ((t10 >> shift) & 0xff)
+            + (1 - dx) * (1 - dy) * ((t00 >> shift) & 0xff);
+    }
+#endif
+}
+
+template <bool Streamed>
+static inline uint32_t Texel(Texture& texture, MipLevel& level, int levelIndex, int x, int y)
+{
+    if (Streamed)
+        return texture.streamed->texel(levelIndex, x, y);
+    return level.texels[level.index(x, y)];
+}
+
+// Samples one level at UV. Texel centres sit at integer multiples of the
+// texel size on level 0, a coarse texel is centred on the level 0 texels it
+// averages, so its lookups are shifted by that part of a texel.
+template <int Interpolation, bool Streamed>
+static void SampleLevel(Vec2f& UV, Texture& texture, int levelIndex, double* ret)
+{
+    MipLevel& level = texture.levels[levelIndex];
+    double offsetx = 0, offsety = 0;
+    if (levelIndex) {
+        offsetx = 0.5 - 0.5 * level.width / texture.levels[0].width;
+        offsety = 0.5 - 0.5 * level.height / texture.levels[0].height;
+    }
+
+#define CLAMPED(a, size) MAX(0, MIN((a), (size)-1))
+#define TEXEL(x, y) Texel<Streamed>(texture, level, levelIndex, x, y)
+    if (Interpolation == NEAREST) {
+        int pixelx = ROUND(UV.x * level.width - offsetx);
+        int pixely = ROUND(UV.y * level.height - offsety);
+        uint32_t texel = TEXEL(CLAMPED(pixelx, level.width), CLAMPED(pixely, level.height));
+        ret[0] = texel & 0xff;
+        ret[1] = (texel >> 8) & 0xff;
+        ret[2] = (texel >> 16) & 0xff;
+    } else {
+        double fx = UV.x * level.width - offsetx;
+        double fy = UV.y * level.height - offsety;
+        // level 0 keeps its original rounding, coarse levels take the four
+        // texels around UV so dx and dy stay in [0, 1) and never extrapolate
+        int pixelx = levelIndex ? (int)floor(fx) : ROUND(fx);
+        int pixely = levelIndex ? (int)floor(fy) : ROUND(fy);
+        double dx = fx - pixelx;
+        double dy = fy - pixely;
+        int x0 = CLAMPED(pixelx, level.width), x1 = CLAMPED(pixelx + 1, level.width);
+        int y0 = CLAMPED(pixely, level.height), y1 = CLAMPED(pixely + 1, level.height);
+#ifdef __SSE2__
+        if (!Streamed && x1 == x0 + 1 && y1 == y0 + 1 && x0 % TILE_SIZE != TILE_SIZE - 1 && y0 % TILE_SIZE != TILE_SIZE - 1) {
+            // whole footprint inside one block, two 8 byte loads from the same cache line
+            size_t i00 = level.index(x0, y0);
+            __m128i top = _mm_loadl_epi64((__m128i*)&level.texels[i00]);
+            __m128i bottom = _mm_loadl_epi64((__m128i*)&level.texels[i00 + TILE_SIZE]);
+            BlendTexels(_mm_unpacklo_epi64(top, bottom), dx, dy, ret);
+            return;
+        }
+#endif
+        BlendTexels(TEXEL(x0, y0), TEXEL(x1, y0), TEXEL(x0, y1), TEXEL(x1, y1), dx, dy, ret);
+    }
+#undef TEXEL
+#undef CLAMPED
+}
+
+template <int Interpolation, int Repeat, int Decal, bool Streamed>
+static void SampleTexture(Vec2f UV, Texture& texture, double lod, const Vec3f& kd, double* diffuse, double* ambient)
+{
+    if (Repeat == REPEAT) {
+        UV.x = UV.x - (int)UV.x;
+        UV.y = UV.y - (int)UV.y;
+    } else {
+        UV.x = MIN(UV.x, 1);
+        UV.y = MIN(UV.y, 1);
+    }
+    double color[3];
+    int last = texture.levels.size() - 1;
+    if (lod <= 0 || last == 0) {
+        SampleLevel<Interpolation, Streamed>(UV, texture, 0, color);
+    } else if (Interpolation == NEAREST) {
+        SampleLevel<NEAREST, Streamed>(UV, texture, MIN(ROUND(lod), last), color);
+    } else {
+        // trilinear, blend the two levels around lod
+        int level = MIN((int)lod, last);
+        double weight = MIN(lod - level, 1);
+        SampleLevel<Interpolation, Streamed>(UV, texture, level, color);
+        if (level < last && weight > 0) {
+            double coarse[3];
+            SampleLevel<Interpolation, Streamed>(UV, texture, level + 1, coarse);
+            for (int c = 0; c < 3; c++)
+                color[c] = (1 - weight) * color[c] + weight * coarse[c];
+        }
+    }
+
+    if (Decal == REPLACE_ALL) {
+        for (int c = 0; c < 3; c++) {
+            diffuse[c] = 0;
+            ambient[c] = color[c];
+        }
+    } else if (Decal == REPLACE_KD) {
+        for (int c = 0; c < 3; c++) {
+            diffuse[c] = color[c] / 255;
+            ambient[c] = 0;
+        }
+    } else {
+        diffuse[0] = (color[0] / 255 + kd.x) / 2;
+        diffuse[1] = (color[1] / 255 + kd.y) / 2;
+        diffuse[2] = (color[2] / 255 + kd.z) / 2;
+        ambient[0] = ambient[1] = ambient[2] = 0;
+    }
+}
+
+// Each step below fixes one mode, the last one instantiates the sampler
+
+template <int Interpolation, int Repeat, int Decal>
+static TextureSampler pickStorage(Texture& texture)
+{
+    if (texture.streamed)
+        return &SampleTexture<Interpolation, Repeat, Decal, true>;
+    return &SampleTexture<Interpolation, Repeat, Decal, false>;
+}
+
+template <int Interpolation, int Repeat>
+static TextureSampler pickDecal(Texture& texture)
+{
+    switch (texture.colormode) {
+    case REPLACE_KD:
+        return pickStorage<Interpolation, Repeat, REPLACE_KD>(texture);
+    case BLEND_KD:
+        return pickStorage<Interpolation, Repeat, BLEND_KD>(texture);
+    case REPLACE_ALL:
+        return pickStorage<Interpolation, Repeat, REPLACE_ALL>(texture);
+    }
+    throw std::runtime_error("Error: Unknown texture decal mode.");
+}
+
+template <int Interpolation>
+static TextureSampler pickRepeat(Texture& texture)
+{
+    switch (texture.repeatmode) {
+    case REPEAT:
+        return pickDecal<Interpolation, REPEAT>(texture);
+    case CLAMP:
+        return pickDecal<Interpolation, CLAMP>(texture);
+    }
+    throw std::runtime_error("Error: Unknown texture appearance.");
+}
+
+TextureSampler texture_sampler(Texture& texture)
+{
+    switch (texture.interpolation) {
+    case NEAREST:
+        return pickRepeat<NEAREST>(texture);
+    case BILINEAR:
+        return pickRepeat<BILINEAR>(texture);
+    }
+    throw std::runtime_error("Error: Unknown texture interpolation.");
+}
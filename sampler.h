@@ -0,0 +1,14 @@
+#ifndef __sampler_h__
+#define __sampler_h__
+
+#include "parser.h"
+
+// Texture lookups compiled once for every combination of interpolation,
+// repeat mode, colour mode and texel storage. The loaders pick the one
+// matching each texture, so a lookup neither branches on the modes nor
+// has to reject unknown ones.
+
+// Sampler for the modes of texture, throws std::runtime_error on unknown modes
+parser::TextureSampler texture_sampler(parser::Texture& texture);
+
+#endif // __sampler_h__
@@ -0,0 +1,137 @@
+#include "texcache.h"
+#include "jpeg.h"
+#include "timer.h"
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <sys/stat.h>
+
+#define MIN(a, b) (((a) > (b)) ? (b) : (a))
+
+struct CacheEntry {
+    std::mutex lock; // held while the image is decoded
+    std::weak_ptr<TextureImage> image;
+};
+
+static std::mutex cacheLock;
+static std::map<std::string, std::shared_ptr<CacheEntry>> cache;
+
+std::string texture_file_key(const std::string& filename)
+{
+    char resolved[PATH_MAX];
+    std::stringstream key;
+    struct stat info;
+    // different spellings of the same file share an entry, a rewritten file gets a new one
+    if (realpath(filename.c_str(), resolved) && stat(resolved, &info) == 0)
+        key << resolved << ':' << info.st_mtim.tv_sec << '.' << info.st_mtim.tv_nsec;
+    else
+        key << filename;
+    return key.str();
+}
+
+TextureImage::~TextureImage()
+{
+    for (int i = 0; i < levels.size(); i++)
+        free(levels[i].texels);
+}
+
+static MipLevel tileLevel(const unsigned char* pixels, int width, int height)
+{
+    MipLevel level;
+    level.width = width;
+    level.height = height;
+    level.blocks_per_row = (width + TILE_SIZE - 1) / TILE_SIZE;
+    void* texels;
+    if (posix_memalign(&texels, 64, level.size() * sizeof(uint32_t)))
+        throw std::bad_alloc();
+    level.texels = (uint32_t*)texels;
+    memset(level.texels, 0, level.size() * sizeof(uint32_t));
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const unsigned char* rgb = pixels + 3 * ((size_t)y * width + x);
+            level.texels[level.index(x, y)] = rgb[0] | (rgb[1] << 8) | (rgb[2] << 16) | 0xff000000u;
+        }
+    }
+    return level;
+}
+
+void build_mipmaps(TextureImage& image, const unsigned char* pixels)
+{
+    int width = image.width, height = image.height;
+    image.levels.clear();
+    image.levels.push_back(tileLevel(pixels, width, height));
+
+    // reduce in plain RGB rows, then tile each level
+    const unsigned char* level = pixels;
+    unsigned char* owned = NULL;
+    while (width > 1 || height > 1) {
+        int nextWidth = width > 1 ? width / 2 : 1;
+        int nextHeight = height > 1 ? height / 2 : 1;
+        unsigned char* next = new unsigned char[(size_t)nextWidth * nextHeight * 3];
+        for (int y = 0; y < nextHeight; y++) {
+            // odd sizes repeat the last row/column of the finer level
+            int y0 = MIN(2 * y, height - 1), y1 = MIN(2 * y + 1, height - 1);
+            for (int x = 0; x < nextWidth; x++) {
+                int x0 = MIN(2 * x, width - 1), x1 = MIN(2 * x + 1, width - 1);
+                for (int c = 0; c < 3; c++) {
+                    int sum = level[3 * ((size_t)y0 * width + x0) + c]
+                        + level[3 * ((size_t)y0 * width + x1) + c]
+                        + level[3 * ((size_t)y1 * width + x0) + c]
+                        + level[3 * ((size_t)y1 * width + x1) + c];
+                    next[3 * ((size_t)y * nextWidth + x) + c] = (sum + 2) / 4;
+                }
+            }
+        }
+        image.levels.push_back(tileLevel(next, nextWidth, nextHeight));
+        delete[] owned;
+        owned = next;
+        level = next;
+        width = nextWidth;
+        height = nextHeight;
+    }
+    delete[] owned;
+}
+
+std::shared_ptr<TextureImage> texture_cache_acquire(const std::string& filename)
+{
+    std::string key = texture_file_key(filename);
+    std::shared_ptr<CacheEntry> entry;
+    {
+        std::lock_guard<std::mutex> guard(cacheLock);
+        // drop entries whose image nobody uses anymore
+        for (auto it = cache.begin(); it != cache.end();) {
+            if (it->second->image.expired() && it->first != key && it->second.unique())
+                it = cache.erase(it);
+            else
+                ++it;
+        }
+        std::shared_ptr<CacheEntry>& slot = cache[key];
+        if (!slot)
+            slot = std::make_shared<CacheEntry>();
+        entry = slot;
+    }
+
+    std::lock_guard<std::mutex> guard(entry->lock);
+    std::shared_ptr<TextureImage> image = entry->image.lock();
+    if (!image) {
+        image = std::make_shared<TextureImage>();
+        unsigned char* pixels;
+        {
+            ScopedTimer timer("decode");
+            read_jpeg_image(filename.c_str(), pixels, image->width, image->height);
+        }
+        try {
+            ScopedTimer timer("mipmaps");
+            build_mipmaps(*image, pixels);
+        } catch (...) {
+            delete[] pixels;
+            throw;
+        }
+        delete[] pixels;
+        entry->image = image;
+    }
+    return image;
+}
@@ -0,0 +1,54 @@
+#ifndef __texcache_h__
+#define __texcache_h__
+
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#define TILE_SIZE 4 // texels per side of a block, one block of RGBA texels is a 64 byte cache line
+#define TILE_TEXELS (TILE_SIZE * TILE_SIZE)
+
+// One level of a mip pyramid. Texels are RGBA bytes (r in the lowest byte)
+// stored in TILE_SIZE x TILE_SIZE blocks, blocks in row-major order, so the
+// 2x2 texels of a bilinear lookup are usually in the same cache line.
+struct MipLevel {
+    uint32_t* texels;
+    int width, height;
+    int blocks_per_row;
+
+    size_t index(int x, int y) const
+    {
+        return ((size_t)(y / TILE_SIZE) * blocks_per_row + x / TILE_SIZE) * TILE_TEXELS + (y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE;
+    }
+    size_t size() const // texels including the padding of partial blocks
+    {
+        return (size_t)blocks_per_row * ((height + TILE_SIZE - 1) / TILE_SIZE) * TILE_TEXELS;
+    }
+};
+
+// Decoded image, shared by every texture that uses the same file
+struct TextureImage {
+    int width, height;
+    std::vector<MipLevel> levels; // levels[0] is full size, each next level halves it down to 1x1
+
+    TextureImage()
+    {
+        width = height = 0;
+    }
+    ~TextureImage();
+};
+
+// Fills image.levels with the tiled RGB pixels and their 2x2 box filtered reductions
+void build_mipmaps(TextureImage& image, const unsigned char* pixels);
+
+// Resolved path and modification time of filename, identifies one version of an image
+std::string texture_file_key(const std::string& filename);
+
+// Returns the decoded image of filename with its mip levels. The file is decoded only if no
+// live texture holds an image of the same path and modification time, and
+// the image is freed when the last texture using it goes away. Safe to call
+// from several threads, callers asking for the same file wait for one decode.
+std::shared_ptr<TextureImage> texture_cache_acquire(const std::string& filename);
+
+#endif // __texcache_h__
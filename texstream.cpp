@@ -0,0 +1,319 @@
+#include "texstream.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MIN(a, b) (((a) > (b)) ? (b) : (a))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+
+#define TEXSTREAM_MAGIC "RTTEX"
+#define TEXSTREAM_VERSION 1
+#define PAGE_BYTES (PAGE_TEXELS * sizeof(uint32_t))
+
+// File layout: header and level sizes padded to PAGE_BYTES, then the pages
+// of every level, each level's pages in row-major order. Inside a page the
+// texels keep the TILE_SIZE x TILE_SIZE block order of MipLevel.
+struct StreamHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t level_count;
+    int32_t width, height;
+};
+
+struct StreamLevelHeader {
+    int32_t width, height;
+};
+
+// One resident page. version is a sequence lock: it is odd while the page is
+// replaced, readers copy a texel and retry through the locked path if the
+// version moved in the meantime.
+struct CacheSlot {
+    std::atomic<uint32_t> version;
+    std::atomic<StreamedTexture*> owner;
+    std::atomic<int> page;
+    std::atomic<bool> referenced; // for the clock replacement
+    std::atomic<uint32_t> texels[PAGE_TEXELS];
+};
+
+struct TileCache {
+    std::mutex lock; // taken on misses only
+    CacheSlot* slots;
+    int slot_count;
+    int hand;
+    uint32_t buffer[PAGE_TEXELS];
+};
+
+static std::string streamDir;
+static TileCache* tileCache = NULL;
+
+void texture_stream_configure(const std::string& dir, size_t cacheBytes)
+{
+    streamDir = dir;
+    mkdir(dir.c_str(), 0777);
+    if (tileCache)
+        return; // the cache lives as long as the process, textures keep pointers into it
+    tileCache = new TileCache;
+    tileCache->slot_count = MAX(16, (int)(cacheBytes / PAGE_BYTES));
+    tileCache->slots = new CacheSlot[tileCache->slot_count];
+    tileCache->hand = 0;
+    for (int i = 0; i < tileCache->slot_count; i++) {
+        CacheSlot& slot = tileCache->slots[i];
+        slot.version.store(0);
+        slot.owner.store(NULL);
+        slot.page.store(-1);
+        slot.referenced.store(false);
+    }
+}
+
+bool texture_stream_enabled()
+{
+    return tileCache != NULL;
+}
+
+static int pageOffset(int x, int y)
+{
+    return ((y / TILE_SIZE) * (PAGE_SIZE / TILE_SIZE) + x / TILE_SIZE) * TILE_TEXELS + (y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE;
+}
+
+// Marks slot as changing, then as holding page of owner (or nothing)
+static void beginReplace(CacheSlot& slot, uint32_t& version)
+{
+    version = slot.version.load(std::memory_order_relaxed);
+    slot.version.store(version + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+static void endReplace(CacheSlot& slot, uint32_t version)
+{
+    slot.version.store(version + 2, std::memory_order_release);
+}
+
+StreamedTexture::StreamedTexture()
+{
+    fd = -1;
+    width = height = 0;
+    page_count = 0;
+    directory = NULL;
+}
+
+StreamedTexture::~StreamedTexture()
+{
+    if (tileCache && directory) {
+        std::lock_guard<std::mutex> guard(tileCache->lock);
+        for (int i = 0; i < tileCache->slot_count; i++) {
+            CacheSlot& slot = tileCache->slots[i];
+            if (slot.owner.load(std::memory_order_relaxed) != this)
+                continue;
+            uint32_t version;
+            beginReplace(slot, version);
+            slot.owner.store(NULL, std::memory_order_relaxed);
+            slot.page.store(-1, std::memory_order_relaxed);
+            endReplace(slot, version);
+        }
+    }
+    delete[] directory;
+    if (fd >= 0)
+        close(fd);
+}
+
+// Locked path, loads the page into the slot chosen by the clock hand
+static uint32_t missTexel(StreamedTexture* texture, int page, int offset)
+{
+    std::lock_guard<std::mutex> guard(tileCache->lock);
+    int index = texture->directory[page].load(std::memory_order_relaxed);
+    if (index < 0) {
+        while (true) {
+            CacheSlot& candidate = tileCache->slots[tileCache->hand];
+            index = tileCache->hand;
+            tileCache->hand = (tileCache->hand + 1) % tileCache->slot_count;
+            if (candidate.owner.load(std::memory_order_relaxed) == NULL)
+                break;
+            if (!candidate.referenced.exchange(false, std::memory_order_relaxed))
+                break;
+        }
+        CacheSlot& slot = tileCache->slots[index];
+
+        ssize_t size = pread(texture->fd, tileCache->buffer, PAGE_BYTES, (off_t)PAGE_BYTES * (1 + page));
+        if (size != PAGE_BYTES)
+            memset(tileCache->buffer, 0, PAGE_BYTES);
+
+        StreamedTexture* previous = slot.owner.load(std::memory_order_relaxed);
+        if (previous)
+            previous->directory[slot.page.load(std::memory_order_relaxed)].store(-1, std::memory_order_relaxed);
+        uint32_t version;
+        beginReplace(slot, version);
+        slot.owner.store(texture, std::memory_order_relaxed);
+        slot.page.store(page, std::memory_order_relaxed);
+        for (int i = 0; i < PAGE_TEXELS; i++)
+            slot.texels[i].store(tileCache->buffer[i], std::memory_order_relaxed);
+        endReplace(slot, version);
+        slot.referenced.store(true, std::memory_order_relaxed);
+        texture->directory[page].store(index, std::memory_order_release);
+    }
+    return tileCache->slots[index].texels[offset].load(std::memory_order_relaxed);
+}
+
+uint32_t StreamedTexture::texel(int level, int x, int y)
+{
+    StreamedLevel& current = levels[level];
+    int page = current.first_page + (y / PAGE_SIZE) * current.pages_per_row + x / PAGE_SIZE;
+    int offset = pageOffset(x % PAGE_SIZE, y % PAGE_SIZE);
+
+    int index = directory[page].load(std::memory_order_acquire);
+    if (index >= 0) {
+        CacheSlot& slot = tileCache->slots[index];
+        uint32_t version = slot.version.load(std::memory_order_acquire);
+        if (!(version & 1) && slot.owner.load(std::memory_order_relaxed) == this && slot.page.load(std::memory_order_relaxed) == page) {
+            uint32_t value = slot.texels[offset].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.version.load(std::memory_order_relaxed) == version) {
+                if (!slot.referenced.load(std::memory_order_relaxed))
+                    slot.referenced.store(true, std::memory_order_relaxed);
+                return value;
+            }
+        }
+    }
+    return missTexel(this, page, offset);
+}
+
+static bool openStream(const std::string& path, StreamedTexture& texture)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    StreamHeader header;
+    StreamLevelHeader levels[64];
+    struct stat info;
+    bool ok = pread(fd, &header, sizeof(header), 0) == sizeof(header)
+        && !memcmp(header.magic, TEXSTREAM_MAGIC, sizeof(TEXSTREAM_MAGIC))
+        && header.version == TEXSTREAM_VERSION
+        && header.level_count > 0 && header.level_count <= 64
+        && pread(fd, levels, sizeof(StreamLevelHeader) * header.level_count, sizeof(header)) == sizeof(StreamLevelHeader) * header.level_count
+        && fstat(fd, &info) == 0;
+    if (!ok) {
+        close(fd);
+        return false;
+    }
+
+    int pages = 0;
+    for (int l = 0; l < header.level_count; l++) {
+        StreamedLevel level;
+        level.width = levels[l].width;
+        level.height = levels[l].height;
+        level.pages_per_row = (level.width + PAGE_SIZE - 1) / PAGE_SIZE;
+        level.first_page = pages;
+        pages += level.pages_per_row * ((level.height + PAGE_SIZE - 1) / PAGE_SIZE);
+        texture.levels.push_back(level);
+    }
+    if (info.st_size != (off_t)PAGE_BYTES * (1 + pages)) {
+        texture.levels.clear();
+        close(fd);
+        return false;
+    }
+
+    texture.fd = fd;
+    texture.width = header.width;
+    texture.height = header.height;
+    texture.page_count = pages;
+    texture.directory = new std::atomic<int>[pages];
+    for (int i = 0; i < pages; i++)
+        texture.directory[i].store(-1);
+    return true;
+}
+
+static void convert(const std::string& filename, const std::string& path)
+{
+    std::shared_ptr<TextureImage> image = texture_cache_acquire(filename);
+
+    std::string temp = path + ".tmp";
+    FILE* out = fopen(temp.c_str(), "wb");
+    if (out == NULL)
+        throw std::runtime_error("Error: can't write texture cache " + temp);
+
+    std::vector<uint32_t> page(PAGE_TEXELS);
+    StreamHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TEXSTREAM_MAGIC, sizeof(TEXSTREAM_MAGIC));
+    header.version = TEXSTREAM_VERSION;
+    header.level_count = image->levels.size();
+    header.width = image->width;
+    header.height = image->height;
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    for (int l = 0; l < image->levels.size(); l++) {
+        StreamLevelHeader level;
+        level.width = image->levels[l].width;
+        level.height = image->levels[l].height;
+        ok = ok && fwrite(&level, sizeof(level), 1, out) == 1;
+    }
+    size_t used = sizeof(header) + sizeof(StreamLevelHeader) * image->levels.size();
+    std::vector<char> padding(PAGE_BYTES - used, 0);
+    ok = ok && fwrite(padding.data(), 1, padding.size(), out) == padding.size();
+
+    for (int l = 0; l < image->levels.size() && ok; l++) {
+        MipLevel& level = image->levels[l];
+        for (int py = 0; py < level.height; py += PAGE_SIZE) {
+            for (int px = 0; px < level.width; px += PAGE_SIZE) {
+                std::fill(page.begin(), page.end(), 0);
+                for (int y = py; y < MIN(py + PAGE_SIZE, level.height); y++) {
+                    for (int x = px; x < MIN(px + PAGE_SIZE, level.width); x++)
+                        page[pageOffset(x - px, y - py)] = level.texels[level.index(x, y)];
+                }
+                ok = ok && fwrite(page.data(), sizeof(uint32_t), PAGE_TEXELS, out) == PAGE_TEXELS;
+            }
+        }
+    }
+    ok = fclose(out) == 0 && ok;
+    if (!ok || rename(temp.c_str(), path.c_str()) != 0) {
+        remove(temp.c_str());
+        throw std::runtime_error("Error: can't write texture cache " + path);
+    }
+}
+
+struct StreamEntry {
+    std::mutex lock; // held while the file is converted and opened
+    std::weak_ptr<StreamedTexture> texture;
+};
+
+static std::mutex streamsLock;
+static std::map<std::string, std::shared_ptr<StreamEntry>> streams;
+
+std::shared_ptr<StreamedTexture> texture_stream_open(const std::string& filename)
+{
+    std::string key = texture_file_key(filename);
+    std::shared_ptr<StreamEntry> entry;
+    {
+        std::lock_guard<std::mutex> guard(streamsLock);
+        std::shared_ptr<StreamEntry>& slot = streams[key];
+        if (!slot)
+            slot = std::make_shared<StreamEntry>();
+        entry = slot;
+    }
+
+    std::lock_guard<std::mutex> guard(entry->lock);
+    std::shared_ptr<StreamedTexture> texture = entry->texture.lock();
+    if (texture)
+        return texture;
+
+    // the file name only depends on path and modification time, so a changed image is converted again
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < key.size(); i++)
+        hash = (hash ^ (unsigned char)key[i]) * 0x100000001b3ULL;
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.tex", (unsigned long long)hash);
+    std::string path = streamDir + name;
+
+    texture = std::make_shared<StreamedTexture>();
+    if (!openStream(path, *texture)) {
+        convert(filename, path);
+        if (!openStream(path, *texture))
+            throw std::runtime_error("Error: can't read texture cache " + path);
+    }
+    entry->texture = texture;
+    return texture;
+}
@@ -0,0 +1,42 @@
+#ifndef __texstream_h__
+#define __texstream_h__
+
+#include "texcache.h"
+#include <atomic>
+
+// Out-of-core textures. Each image is converted once into <dir>/<key>.tex,
+// its tiled mip levels cut into pages of PAGE_SIZE x PAGE_SIZE texels (4 KB).
+// Render threads read texels through a fixed-size page cache shared by all
+// textures; hits take no lock, misses read the page from the file.
+
+#define PAGE_SIZE 32
+#define PAGE_TEXELS (PAGE_SIZE * PAGE_SIZE)
+
+struct StreamedLevel {
+    int width, height;
+    int pages_per_row;
+    int first_page; // index of the level's first page in the texture
+};
+
+struct StreamedTexture {
+    int fd;
+    int width, height;
+    std::vector<StreamedLevel> levels;
+    int page_count;
+    std::atomic<int>* directory; // cache slot holding each page, -1 if not cached
+
+    StreamedTexture();
+    ~StreamedTexture();
+
+    // RGBA texel in the same packing as MipLevel, x and y must be inside the level
+    uint32_t texel(int level, int x, int y);
+};
+
+// Turns streaming on for textures loaded afterwards, cacheBytes bounds the resident pages
+void texture_stream_configure(const std::string& dir, size_t cacheBytes);
+bool texture_stream_enabled();
+
+// Opens the converted file of filename, converting it first if it is missing or stale
+std::shared_ptr<StreamedTexture> texture_stream_open(const std::string& filename);
+
+#endif // __texstream_h__
@@ -0,0 +1,106 @@
+#include "timer.h"
+#include <atomic>
+#include <cstring>
+#include <iomanip>
+#include <mutex>
+#include <vector>
+
+struct TimerNode {
+    const char* name;
+    TimerNode* parent;
+    std::vector<TimerNode*> children; // in the order they first ran
+    std::atomic<long long> nanoseconds;
+    std::atomic<long> count;
+};
+
+bool timers_on = false;
+
+static std::mutex treeLock; // taken when a phase starts, to find or add its node
+static TimerNode root;
+static thread_local TimerNode* current = NULL;
+
+void timers_enable(bool on)
+{
+    timers_on = on;
+}
+
+TimerNode* timer_current()
+{
+    return current;
+}
+
+void timer_set_current(TimerNode* node)
+{
+    current = node;
+}
+
+TimerNode* timer_begin(const char* name)
+{
+    TimerNode* parent = current ? current : &root;
+    TimerNode* node = NULL;
+    {
+        std::lock_guard<std::mutex> guard(treeLock);
+        for (int i = 0; i < parent->children.size() && !node; i++) {
+            if (!strcmp(parent->children[i]->name, name))
+                node = parent->children[i];
+        }
+        if (!node) {
+            node = new TimerNode;
+            node->name = name;
+            node->parent = parent;
+            node->nanoseconds.store(0);
+            node->count.store(0);
+            parent->children.push_back(node);
+        }
+    }
+    current = node;
+    return node;
+}
+
+void timer_end(TimerNode* node, std::chrono::steady_clock::time_point start)
+{
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    node->nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    node->count++;
+    current = node->parent == &root ? NULL : node->parent;
+}
+
+static void printNode(std::ostream& out, TimerNode* node, int depth)
+{
+    for (int i = 0; i < node->children.size(); i++) {
+        TimerNode* child = node->children[i];
+        if (child->count == 0)
+            continue;
+        out << std::string(2 * depth, ' ') << std::left << std::setw(24 - 2 * depth) << child->name
+            << std::right << std::fixed << std::setprecision(3) << std::setw(12) << child->nanoseconds / 1e6 << " ms";
+        if (child->count > 1)
+            out << "  x" << child->count;
+        out << std::endl;
+        printNode(out, child, depth + 1);
+    }
+}
+
+void timers_print(std::ostream& out)
+{
+    std::lock_guard<std::mutex> guard(treeLock);
+    std::ios::fmtflags flags = out.flags();
+    std::streamsize precision = out.precision();
+    printNode(out, &root, 0);
+    out.flags(flags);
+    out.precision(precision);
+}
+
+static void resetNode(TimerNode* node)
+{
+    for (int i = 0; i < node->children.size(); i++) {
+        node->children[i]->nanoseconds.store(0);
+        node->children[i]->count.store(0);
+        resetNode(node->children[i]);
+    }
+}
+
+void timers_reset()
+{
+    std::lock_guard<std::mutex> guard(treeLock);
+    resetNode(&root);
+}
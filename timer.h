@@ -0,0 +1,54 @@
+#ifndef __timer_h__
+#define __timer_h__
+
+#include <chrono>
+#include <iostream>
+
+// Wall clock timers for the phases of a run, enabled by --stats. A
+// ScopedTimer adds the time of its scope to the phase of that name nested
+// under the phase open on the same thread. parallel_for hands the open
+// phase to its workers, so a phase timed on several threads adds up their
+// times. While timers are disabled a ScopedTimer costs one branch.
+
+struct TimerNode;
+
+extern bool timers_on;
+
+void timers_enable(bool on);
+// Prints the phases timed since the last reset with their times and counts, indented by nesting
+void timers_print(std::ostream& out);
+void timers_reset();
+
+// Phase open on the calling thread, NULL for none
+TimerNode* timer_current();
+void timer_set_current(TimerNode* node);
+
+TimerNode* timer_begin(const char* name);
+void timer_end(TimerNode* node, std::chrono::steady_clock::time_point start);
+
+struct ScopedTimer {
+    TimerNode* node;
+    std::chrono::steady_clock::time_point start;
+
+    ScopedTimer(const char* name)
+    {
+        node = NULL;
+        if (timers_on) {
+            node = timer_begin(name);
+            start = std::chrono::steady_clock::now();
+        }
+    }
+    ~ScopedTimer()
+    {
+        stop();
+    }
+    // Ends the phase before the end of the scope
+    void stop()
+    {
+        if (node)
+            timer_end(node, start);
+        node = NULL;
+    }
+};
+
+#endif // __timer_h__